@@ -0,0 +1,705 @@
+// bench.cpp - throughput benchmarks for the step6 ext2/VDI code.
+//
+// Build: g++ -std=c++17 -O2 -pthread -o bench bench.cpp
+// Usage: bench threads <vdi file> [max threads] [--mmap]
+//        bench async <vdi file> [queue depth]
+//        bench extract <vdi file>
+//        bench lookup <vdi file> <directory path> [lookups]
+//        bench walk <vdi file> [max threads]
+//        bench age <vdi file> [files]
+//        bench frag <vdi file> [files]
+//        bench create <vdi file> [files]
+
+#define STEP6_NO_MAIN
+#include "step6.cpp"
+
+#include <chrono>
+#include <fstream>
+#include <thread>
+
+static double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// BENCH threads: random ext2ReadBlock calls from 1..N threads sharing one
+// open image. Every thread reads the same number of blocks, so perfect
+// scaling shows up as constant time per run and N times the MB/s.
+static int benchThreads(Ext2File &fs, unsigned maxThreads)
+{
+    const uint32_t readsPerThread = 20000;
+    uint32_t totalBlocks = fs.sb.s_blocks_count;
+
+    std::vector<unsigned> counts;
+    for (unsigned n = 1; n < maxThreads; n *= 2)
+        counts.push_back(n);
+    counts.push_back(maxThreads);
+
+    std::cout << std::setfill(' ') << "threads |  blocks  |  seconds  |   MB/s\n";
+    for (unsigned n : counts)
+    {
+        std::vector<std::thread> workers;
+        auto start = std::chrono::steady_clock::now();
+        for (unsigned t = 0; t < n; t++)
+        {
+            workers.emplace_back([&fs, t, totalBlocks]()
+                                 {
+                std::vector<uint8_t> buf(fs.blockSize);
+                uint64_t x = 0x9E3779B97F4A7C15ULL * (t + 1);
+                for (uint32_t i = 0; i < readsPerThread; i++)
+                {
+                    x ^= x << 13;
+                    x ^= x >> 7;
+                    x ^= x << 17;
+                    ext2ReadBlock(fs, (uint32_t)(x % totalBlocks), buf.data());
+                } });
+        }
+        for (auto &w : workers)
+            w.join();
+        double secs = secondsSince(start);
+        double mb = double(readsPerThread) * n * fs.blockSize / (1024.0 * 1024.0);
+        std::cout << std::setw(7) << n << " | " << std::setw(8) << readsPerThread * n
+                  << " | " << std::setw(9) << std::fixed << std::setprecision(3) << secs
+                  << " | " << std::setw(8) << std::setprecision(1) << mb / secs << "\n";
+    }
+    return 0;
+}
+
+// Asks the kernel to drop its cached pages of the image so the next run
+// starts cold (best effort, no root needed).
+static void dropImageCache(VDIFile &vdi)
+{
+    posix_fadvise(vdi.fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+// Largest regular (non-reserved) file in the inode tables, 0 if none.
+static uint32_t findLargestFile(Ext2File &fs, unsigned depth, uint32_t &size)
+{
+    uint32_t bigINum = 0;
+    size = 0;
+    scanInodeTablesAsync(&fs, depth, [&](uint32_t iNum, const Inode &inode)
+                         {
+        if (iNum >= fs.sb.s_first_ino && (inode.i_mode & 0xF000) == 0x8000 &&
+            inode.i_links_count && inode.i_size > size)
+        {
+            size = inode.i_size;
+            bigINum = iNum;
+        } });
+    return bigINum;
+}
+
+// BENCH async: inode-table scan and whole-file read, one synchronous
+// ext2ReadBlock at a time versus the async reader at the given depth.
+static int benchAsync(Ext2File &fs, unsigned depth)
+{
+    uint32_t ipg = fs.sb.s_inodes_per_group;
+    uint32_t inodesPerBlock = fs.blockSize / fs.inodeSize;
+    uint32_t tableBlocks = (ipg + inodesPerBlock - 1) / inodesPerBlock;
+    double tableMB = double(tableBlocks) * fs.numBlockGroups * fs.blockSize / (1024.0 * 1024.0);
+
+    // largest regular file found in the inode tables drives the file test
+    uint32_t bigSize;
+    uint32_t bigINum = findLargestFile(fs, depth, bigSize);
+
+    std::cout << std::setfill(' ') << std::fixed << std::setprecision(1);
+
+    dropImageCache(*fs.part->vdi);
+    auto start = std::chrono::steady_clock::now();
+    std::vector<uint8_t> buf(fs.blockSize);
+    for (uint32_t g = 0; g < fs.numBlockGroups; g++)
+        for (uint32_t b = 0; b < tableBlocks; b++)
+            ext2ReadBlock(fs, fs.bgdt[g].bg_inode_table + b, buf.data());
+    double syncSecs = secondsSince(start);
+
+    dropImageCache(*fs.part->vdi);
+    start = std::chrono::steady_clock::now();
+    uint64_t seen = 0;
+    scanInodeTablesAsync(&fs, depth, [&seen](uint32_t, const Inode &)
+                         { seen++; });
+    double asyncSecs = secondsSince(start);
+
+    std::cout << "inode tables: " << tableMB << " MB, sync " << tableMB / syncSecs
+              << " MB/s, async(depth " << depth << ") " << tableMB / asyncSecs << " MB/s\n";
+
+    if (bigINum == 0)
+        return 0;
+    Inode inode;
+    fetchInode(&fs, bigINum, &inode);
+    double fileMB = bigSize / (1024.0 * 1024.0);
+    uint32_t count = (bigSize + fs.blockSize - 1) / fs.blockSize;
+
+    dropImageCache(*fs.part->vdi);
+    start = std::chrono::steady_clock::now();
+    for (uint32_t b = 0; b < count; b++)
+        fetchBlockFromFile(&fs, &inode, b, buf.data());
+    syncSecs = secondsSince(start);
+
+    dropImageCache(*fs.part->vdi);
+    start = std::chrono::steady_clock::now();
+    readFileAsync(&fs, &inode, depth, [](uint32_t, const uint8_t *) {});
+    asyncSecs = secondsSince(start);
+
+    std::cout << "inode " << bigINum << ": " << fileMB << " MB, sync " << fileMB / syncSecs
+              << " MB/s, async(depth " << depth << ") " << fileMB / asyncSecs << " MB/s\n";
+    return 0;
+}
+
+// BENCH extract: whole-file read of the largest file, one
+// fetchBlockFromFile per block versus readFileBlocks with coalesced runs.
+static int benchExtract(Ext2File &fs)
+{
+    uint32_t size;
+    uint32_t iNum = findLargestFile(fs, 64, size);
+    if (iNum == 0)
+    {
+        std::cerr << "No regular files to read\n";
+        return 1;
+    }
+    Inode inode;
+    fetchInode(&fs, iNum, &inode);
+    uint32_t count = (size + fs.blockSize - 1) / fs.blockSize;
+    std::vector<uint8_t> out((size_t)count * fs.blockSize);
+    double mb = size / (1024.0 * 1024.0);
+    std::cout << std::setfill(' ') << std::fixed << std::setprecision(1);
+
+    dropImageCache(*fs.part->vdi);
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t b = 0; b < count; b++)
+        fetchBlockFromFile(&fs, &inode, b, out.data() + (size_t)b * fs.blockSize);
+    double perBlock = secondsSince(start);
+
+    dropImageCache(*fs.part->vdi);
+    start = std::chrono::steady_clock::now();
+    readFileBlocks(&fs, &inode, 0, count, out.data());
+    double ranged = secondsSince(start);
+
+    std::cout << "inode " << iNum << ": " << mb << " MB, per-block " << mb / perBlock
+              << " MB/s, range " << mb / ranged << " MB/s\n";
+    return 0;
+}
+
+// BENCH lookup: random names from one directory looked up by scanning
+// every block versus through the htree. The dentry cache is bypassed; the
+// block cache stays on, so "blocks" counts block lookups, not disk reads.
+static int benchLookup(Ext2File &fs, const std::string &dirPath, unsigned samples)
+{
+    uint32_t dirINum = lookupPath(&fs, dirPath);
+    Inode dir;
+    if (dirINum == 0 || fetchInode(&fs, dirINum, &dir) != 0 || (dir.i_mode & 0xF000) != 0x4000)
+    {
+        std::cerr << "Not a directory: " << dirPath << "\n";
+        return 1;
+    }
+    std::vector<std::string> names;
+    Directory *d = openDir(&fs, dirINum);
+    uint32_t iNum;
+    char name[256];
+    while (getNextDirent(d, iNum, name))
+        names.push_back(name);
+    closeDir(d);
+
+    std::vector<std::string> picks;
+    uint64_t x = 0x9E3779B97F4A7C15ULL;
+    for (unsigned i = 0; i < samples; i++)
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        picks.push_back(names[x % names.size()]);
+    }
+
+    bool indexed = false;
+    htreeLookup(&fs, &dir, picks[0], indexed);
+    std::cout << std::setfill(' ') << std::fixed << std::setprecision(2)
+              << dirPath << ": " << names.size() << " entries, "
+              << dir.i_size / fs.blockSize << " blocks, "
+              << (indexed ? "indexed" : "not indexed") << "\n";
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        if (pass == 1 && !indexed)
+            break;
+        uint64_t before = fs.cache.hits + fs.cache.misses;
+        auto start = std::chrono::steady_clock::now();
+        for (const std::string &n : picks)
+        {
+            bool usable;
+            if (pass == 0)
+                linearLookup(&fs, &dir, n);
+            else
+                htreeLookup(&fs, &dir, n, usable);
+        }
+        double secs = secondsSince(start);
+        uint64_t blocks = fs.cache.hits + fs.cache.misses - before;
+        std::cout << (pass == 0 ? "  linear: " : "  htree:  ") << std::setw(10)
+                  << secs * 1e6 / samples << " us/lookup, " << std::setw(8)
+                  << double(blocks) / samples << " blocks/lookup\n";
+    }
+    return 0;
+}
+
+// BENCH walk: `du` of the whole tree (every entry visited, every regular
+// file's inode read for its size) with walkTree on 1..N threads. Caches
+// are emptied before each run so every run reads the same metadata.
+static int benchWalk(Ext2File &fs, unsigned maxThreads)
+{
+    std::vector<unsigned> counts;
+    for (unsigned n = 1; n < maxThreads; n *= 2)
+        counts.push_back(n);
+    counts.push_back(maxThreads);
+
+    std::cout << std::setfill(' ') << "threads |  entries  |   bytes (MB) |  seconds  | entries/s\n";
+    for (unsigned n : counts)
+    {
+        ext2FlushCache(fs);
+        ext2SetCacheSize(fs, 0);
+        ext2SetCacheSize(fs, EXT2_DEFAULT_CACHE_BLOCKS);
+        setInodeCacheSize(&fs, 0);
+        setInodeCacheSize(&fs, EXT2_DEFAULT_CACHE_INODES);
+        dropImageCache(*fs.part->vdi);
+
+        std::atomic<uint64_t> entries{0}, bytes{0};
+        auto start = std::chrono::steady_clock::now();
+        walkTree(&fs, 2, "/", n, [&](const std::string &, uint32_t iNum, uint8_t type)
+                 {
+            entries++;
+            if (type == EXT2_FT_REG_FILE)
+            {
+                Inode inode;
+                if (fetchInode(&fs, iNum, &inode) == 0)
+                    bytes += inodeSize(&inode);
+            }
+            return true; });
+        double secs = secondsSince(start);
+        std::cout << std::setw(7) << n << " | " << std::setw(9) << entries.load() << " | "
+                  << std::setw(12) << std::fixed << std::setprecision(1) << bytes.load() / (1024.0 * 1024.0)
+                  << " | " << std::setw(9) << std::setprecision(3) << secs << " | "
+                  << std::setw(9) << std::setprecision(0) << entries.load() / secs << "\n";
+    }
+    return 0;
+}
+
+// Copies an image to a scratch file for the benchmarks that write.
+static bool copyImage(const std::string &from, const std::string &to)
+{
+    std::ifstream in(from, std::ios::binary);
+    std::ofstream out(to, std::ios::binary | std::ios::trunc);
+    if (!in || !(out << in.rdbuf()))
+    {
+        std::cerr << "cannot copy " << from << " to " << to << "\n";
+        return false;
+    }
+    return true;
+}
+
+// Creates the aging workload in a fresh copy of the image: a few top-level
+// directories with subdirectories, then `files` files of 1..32 blocks
+// created round-robin across the leaf directories, so files of different
+// directories are interleaved in time the way a busy system writes them.
+// Returns the leaf directories, or an empty list on failure.
+static std::vector<uint32_t> ageImage(Ext2File &fs, unsigned files)
+{
+    const unsigned topDirs = 8, subDirs = 4;
+    std::vector<uint32_t> leaves;
+    for (unsigned t = 0; t < topDirs; t++)
+    {
+        uint32_t top = createInode(&fs, 2, "age" + std::to_string(t), 0x41ED);
+        if (top == 0)
+            return {};
+        for (unsigned s = 0; s < subDirs; s++)
+        {
+            uint32_t leaf = createInode(&fs, top, "d" + std::to_string(s), 0x41ED);
+            if (leaf == 0)
+                return {};
+            leaves.push_back(leaf);
+        }
+    }
+
+    std::vector<uint8_t> data(32 * fs.blockSize, 0xA5);
+    uint32_t seed = 12345;
+    for (unsigned f = 0; f < files; f++)
+    {
+        seed = seed * 1103515245 + 12345;
+        uint32_t blocks = 1 + (seed >> 16) % 32;
+        uint32_t dir = leaves[f % leaves.size()];
+        uint32_t iNum = createInode(&fs, dir, "f" + std::to_string(f), 0x81A4);
+        Inode inode;
+        if (iNum == 0 || fetchInode(&fs, iNum, &inode) != 0 ||
+            writeFileBlocks(&fs, iNum, &inode, 0, blocks, data.data()) != 0)
+        {
+            std::cerr << "age: disk full after " << f << " files\n";
+            break;
+        }
+        writeInode(&fs, iNum, &inode);
+        releaseReservation(&fs, iNum);
+    }
+    return leaves;
+}
+
+// BENCH age: runs the same aging workload on two scratch copies of the
+// image, one with first-fit placement from group 0 and one with
+// locality-aware placement, then reads every leaf directory back
+// (readDirPlus plus every file's data) from a cold cache. The locality
+// columns follow the blocks one directory's read touches, in order:
+// average jump between consecutive blocks, and distance from an inode's
+// table block to its first data block.
+static int benchAge(const std::string &image, unsigned files)
+{
+    std::cout << std::setfill(' ')
+              << "placement | groups/dir | jump (blocks) | inode->data |  seconds\n";
+    for (int pass = 0; pass < 2; pass++)
+    {
+        std::string scratch = image + ".age";
+        if (!copyImage(image, scratch))
+            return 1;
+
+        VDIFile vdi;
+        MBRPartition part;
+        Ext2File fs;
+        if (!vdiOpen(vdi, scratch.c_str()) || !mbrOpen(part, vdi, 0) || !ext2Open(fs, part))
+        {
+            unlink(scratch.c_str());
+            return 1;
+        }
+        fs.localPlacement = pass == 1;
+        std::vector<uint32_t> leaves = ageImage(fs, files);
+        if (leaves.empty())
+        {
+            ext2Close(fs);
+            vdiClose(vdi);
+            unlink(scratch.c_str());
+            std::cerr << "age: could not create the directory tree\n";
+            return 1;
+        }
+
+        // write everything out, then start the read-back with empty caches
+        ext2Sync(fs);
+        ext2SetCacheSize(fs, 0);
+        ext2SetCacheSize(fs, EXT2_DEFAULT_CACHE_BLOCKS);
+        setInodeCacheSize(&fs, 0);
+        setInodeCacheSize(&fs, EXT2_DEFAULT_CACHE_INODES);
+        dropImageCache(vdi);
+        double groups = 0, jump = 0, jumps = 0, dist = 0, dists = 0;
+        std::vector<uint8_t> buf;
+        auto start = std::chrono::steady_clock::now();
+        for (uint32_t leaf : leaves)
+        {
+            std::vector<DirEntryPlus> entries;
+            readDirPlus(&fs, leaf, entries);
+            std::vector<uint32_t> touched;
+            std::set<uint32_t> groupSet;
+            uint32_t itBlock, off;
+            for (const DirEntryPlus &e : entries)
+            {
+                if ((e.inode.i_mode & 0xF000) != 0x8000)
+                    continue;
+                inodeLocation(&fs, e.iNum, itBlock, off);
+                touched.push_back(itBlock);
+                uint32_t n = (uint32_t)((inodeSize(&e.inode) + fs.blockSize - 1) / fs.blockSize);
+                std::vector<uint32_t> phys;
+                listFileBlocks(&fs, &e.inode, n, phys);
+                if (!phys.empty())
+                {
+                    dist += std::abs((double)phys[0] - itBlock);
+                    dists++;
+                }
+                touched.insert(touched.end(), phys.begin(), phys.end());
+                buf.resize((size_t)std::max(1u, n) * fs.blockSize);
+                if (n)
+                    readFileBlocks(&fs, &e.inode, 0, n, buf.data());
+            }
+            for (size_t i = 0; i < touched.size(); i++)
+            {
+                groupSet.insert((touched[i] - fs.sb.s_first_data_block) / fs.sb.s_blocks_per_group);
+                if (i)
+                {
+                    jump += std::abs((double)touched[i] - touched[i - 1]);
+                    jumps++;
+                }
+            }
+            groups += groupSet.size();
+        }
+        double secs = secondsSince(start);
+        std::cout << std::setfill(' ') << (pass == 0 ? "first fit" : " locality") << " | " << std::setw(10) << std::fixed
+                  << std::setprecision(1) << groups / leaves.size() << " | " << std::setw(13)
+                  << (jumps ? jump / jumps : 0) << " | " << std::setw(11) << (dists ? dist / dists : 0)
+                  << " | " << std::setw(8) << std::setprecision(3) << secs << "\n";
+
+        ext2Close(fs);
+        vdiClose(vdi);
+        unlink(scratch.c_str());
+    }
+    return 0;
+}
+
+// Number of physically contiguous runs in logical blocks [0, n) of a file.
+static uint32_t countRuns(Ext2File &fs, const Inode &inode, uint32_t n)
+{
+    std::vector<uint32_t> phys;
+    listFileBlocks(&fs, &inode, n, phys);
+    uint32_t runs = 0;
+    for (uint32_t i = 0; i < n; i++)
+        if (i == 0 || phys[i] != phys[i - 1] + 1)
+            runs++;
+    return runs;
+}
+
+// BENCH frag: breaks free space up like an aged disk (allocates every free
+// block as small files of 1..16 blocks and, one time in 16, large ones of
+// 64..1023, then gives back a random half), then appends `files` files of
+// 4 MB in 256 KB writes, round-robin: allocating first-fit from the
+// bitmaps, through the free-extent index, and through the index with
+// per-file reservation windows. Reports physical runs
+// per file and their average length; each run of one file is a seek.
+static int benchFrag(const std::string &image, unsigned files)
+{
+    const char *names[] = {"bitmap scan ", "extent index", "reservations"};
+    std::cout << "allocator    | runs/file | blocks/run |  seconds\n";
+    for (int pass = 0; pass < 3; pass++)
+    {
+        std::string scratch = image + ".frag";
+        if (!copyImage(image, scratch))
+            return 1;
+        VDIFile vdi;
+        MBRPartition part;
+        Ext2File fs;
+        if (!vdiOpen(vdi, scratch.c_str()) || !mbrOpen(part, vdi, 0) || !ext2Open(fs, part))
+        {
+            unlink(scratch.c_str());
+            return 1;
+        }
+        fs.freeIndex.built = pass > 0;
+        fs.rsv.enabled = pass == 2;
+
+        uint32_t seed = 4242;
+        std::vector<uint32_t> chunk, release;
+        for (;;)
+        {
+            seed = seed * 1103515245 + 12345;
+            chunk.clear();
+            uint32_t size = (seed >> 28) ? 1 + (seed >> 16) % 16 : 64 + (seed >> 16) % 960;
+            if (allocateBlocks(&fs, size, 0, chunk) == 0)
+                break;
+            if ((seed >> 8) & 1)
+                release.insert(release.end(), chunk.begin(), chunk.end());
+        }
+        releaseBlocks(&fs, release);
+
+        uint32_t perFile = (4u << 20) / fs.blockSize;
+        uint32_t perWrite = std::max(1u, (256u << 10) / fs.blockSize);
+        std::vector<uint8_t> data((size_t)perWrite * fs.blockSize, 0x3C);
+        std::vector<uint32_t> iNums;
+        std::vector<Inode> inodes;
+        for (unsigned f = 0; f < files; f++)
+        {
+            uint32_t iNum = createInode(&fs, 2, "frag" + std::to_string(f), 0x81A4);
+            if (iNum == 0)
+                break;
+            iNums.push_back(iNum);
+            inodes.emplace_back();
+            fetchInode(&fs, iNum, &inodes.back());
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        uint32_t written = 0;
+        bool full = false;
+        for (uint32_t b = 0; b < perFile && !full; b += perWrite)
+        {
+            for (size_t f = 0; f < iNums.size() && !full; f++)
+                full = writeFileBlocks(&fs, iNums[f], &inodes[f], b, std::min(perWrite, perFile - b), data.data()) != 0;
+            if (!full)
+                written = std::min(perFile, b + perWrite);
+        }
+        double secs = secondsSince(start);
+
+        uint64_t runs = 0;
+        for (size_t f = 0; f < iNums.size(); f++)
+        {
+            writeInode(&fs, iNums[f], &inodes[f]);
+            releaseReservation(&fs, iNums[f]);
+            runs += countRuns(fs, inodes[f], written);
+        }
+        if (full)
+            std::cerr << "frag: disk full after " << written << " blocks per file\n";
+        double perFileRuns = iNums.empty() ? 0 : double(runs) / iNums.size();
+        std::cout << std::setfill(' ') << names[pass] << " | "
+                  << std::setw(9) << std::fixed << std::setprecision(1) << perFileRuns << " | "
+                  << std::setw(10) << (runs ? double(written) * iNums.size() / runs : 0) << " | "
+                  << std::setw(8) << std::setprecision(3) << secs << "\n";
+
+        ext2Close(fs);
+        vdiClose(vdi);
+        unlink(scratch.c_str());
+    }
+    return 0;
+}
+
+// Write system calls made by this process so far (/proc/self/io), or 0
+// where that is not available.
+static uint64_t writeSyscalls()
+{
+    std::ifstream io("/proc/self/io");
+    std::string key;
+    uint64_t value;
+    while (io >> key >> value)
+        if (key == "syscw:")
+            return value;
+    return 0;
+}
+
+// BENCH create: creates `files` one-block files spread round-robin over
+// 16 directories on a scratch copy of the image, then syncs, once writing
+// dirty blocks back one at a time in LRU order and once through the
+// sorted, merged write-back. Counts write system calls (image and all)
+// and the write calls the block cache issued.
+static int benchCreate(const std::string &image, unsigned files)
+{
+    std::cout << "write-back |  cache writes | syscalls |  seconds\n";
+    for (int pass = 0; pass < 2; pass++)
+    {
+        std::string scratch = image + ".create";
+        if (!copyImage(image, scratch))
+            return 1;
+        VDIFile vdi;
+        MBRPartition part;
+        Ext2File fs;
+        if (!vdiOpen(vdi, scratch.c_str()) || !mbrOpen(part, vdi, 0) || !ext2Open(fs, part))
+        {
+            unlink(scratch.c_str());
+            return 1;
+        }
+        fs.cache.elevator = pass == 1;
+
+        uint64_t syscalls = writeSyscalls();
+        auto start = std::chrono::steady_clock::now();
+        std::vector<uint32_t> dirs;
+        for (unsigned d = 0; d < 16; d++)
+            dirs.push_back(createInode(&fs, 2, "create" + std::to_string(d), 0x41ED));
+        std::vector<uint8_t> data(fs.blockSize, 0x77);
+        for (unsigned f = 0; f < files; f++)
+        {
+            uint32_t dir = dirs[f % dirs.size()];
+            uint32_t iNum = dir ? createInode(&fs, dir, "f" + std::to_string(f), 0x81A4) : 0;
+            Inode inode;
+            if (iNum == 0 || fetchInode(&fs, iNum, &inode) != 0 ||
+                writeFileBlocks(&fs, iNum, &inode, 0, 1, data.data()) != 0)
+            {
+                std::cerr << "create: failed after " << f << " files\n";
+                break;
+            }
+            writeInode(&fs, iNum, &inode);
+            releaseReservation(&fs, iNum);
+        }
+        ext2Sync(fs);
+        fsync(vdi.fd);
+        double secs = secondsSince(start);
+        syscalls = writeSyscalls() - syscalls;
+
+        std::cout << std::setfill(' ') << (pass == 0 ? "  per block" : "   elevator") << " | "
+                  << std::setw(13) << fs.cache.writeRuns << " | " << std::setw(8) << syscalls << " | "
+                  << std::setw(8) << std::fixed << std::setprecision(3) << secs << "\n";
+
+        ext2Close(fs);
+        vdiClose(vdi);
+        unlink(scratch.c_str());
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        std::cerr << "Usage: " << argv[0] << " threads <vdi file> [max threads] [--mmap]\n"
+                  << "       " << argv[0] << " async <vdi file> [queue depth]\n"
+                  << "       " << argv[0] << " extract <vdi file>\n"
+                  << "       " << argv[0] << " lookup <vdi file> <directory path> [lookups]\n"
+                  << "       " << argv[0] << " walk <vdi file> [max threads]\n"
+                  << "       " << argv[0] << " age <vdi file> [files]\n"
+                  << "       " << argv[0] << " frag <vdi file> [files]\n"
+                  << "       " << argv[0] << " create <vdi file> [files]\n";
+        return 1;
+    }
+    std::string mode = argv[1];
+    std::vector<std::string> args(argv + 3, argv + argc);
+    if (mode == "age")
+    {
+        // works on scratch copies; the image itself is never written
+        unsigned files = args.empty() ? 2000 : (unsigned)std::stoul(args[0]);
+        return benchAge(argv[2], std::max(1u, files));
+    }
+    if (mode == "frag")
+    {
+        unsigned files = args.empty() ? 4 : (unsigned)std::stoul(args[0]);
+        return benchFrag(argv[2], std::max(1u, files));
+    }
+    if (mode == "create")
+    {
+        unsigned files = args.empty() ? 5000 : (unsigned)std::stoul(args[0]);
+        return benchCreate(argv[2], std::max(1u, files));
+    }
+    bool useMmap = false;
+    for (auto it = args.begin(); it != args.end();)
+    {
+        if (*it == "--mmap")
+        {
+            useMmap = true;
+            it = args.erase(it);
+        }
+        else
+            ++it;
+    }
+
+    VDIFile vdi;
+    if (!vdiOpen(vdi, argv[2], useMmap))
+        return 1;
+    MBRPartition part;
+    if (!mbrOpen(part, vdi, 0))
+        return 1;
+    Ext2File fs;
+    if (!ext2Open(fs, part))
+        return 1;
+
+    int rc = 1;
+    if (mode == "threads")
+    {
+        unsigned maxThreads = args.empty() ? std::max(1u, std::thread::hardware_concurrency())
+                                           : (unsigned)std::stoul(args[0]);
+        rc = benchThreads(fs, std::max(1u, maxThreads));
+    }
+    else if (mode == "async")
+    {
+        unsigned depth = args.empty() ? 64 : (unsigned)std::stoul(args[0]);
+        rc = benchAsync(fs, std::max(1u, depth));
+    }
+    else if (mode == "extract")
+    {
+        rc = benchExtract(fs);
+    }
+    else if (mode == "lookup")
+    {
+        if (args.empty())
+        {
+            std::cerr << "lookup needs a directory path\n";
+        }
+        else
+        {
+            unsigned samples = args.size() > 1 ? (unsigned)std::stoul(args[1]) : 1000;
+            rc = benchLookup(fs, args[0], std::max(1u, samples));
+        }
+    }
+    else if (mode == "walk")
+    {
+        unsigned maxThreads = args.empty() ? std::max(1u, std::thread::hardware_concurrency())
+                                           : (unsigned)std::stoul(args[0]);
+        rc = benchWalk(fs, std::max(1u, maxThreads));
+    }
+    else
+    {
+        std::cerr << "Unknown benchmark '" << mode << "'\n";
+    }
+
+    ext2Close(fs);
+    vdiClose(vdi);
+    return rc;
+}
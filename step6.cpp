@@ -2,7 +2,6 @@
 // 1)step4.cpp basically Combines step3 + additional inode functionalities
 
 #include <iostream>
-#include <fstream>
 #include <vector>
 #include <cstdint>
 #include <cstring>
@@ -10,7 +9,32 @@
 #include <ctime>
 #include <cctype>
 #include <cmath>
+#include <cerrno>
+#include <climits>
 #include <string>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <deque>
+#include <list>
+#include <map>
+#include <set>
+#include <tuple>
+#include <unordered_map>
+#include <functional>
+#include <algorithm>
+#include <condition_variable>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #pragma pack(push, 1)
 struct VDIHeader
@@ -19,17 +43,41 @@ struct VDIHeader
 };
 #pragma pack(pop)
 
+// imageType values and special block map entries
+const uint32_t VDI_TYPE_DYNAMIC = 1;
+const uint32_t VDI_TYPE_FIXED = 2;
+const uint32_t VDI_BLOCK_FREE = 0xFFFFFFFF; // never written, reads as zeros
+const uint32_t VDI_BLOCK_ZERO = 0xFFFFFFFE; // discarded, reads as zeros
+
+// All image I/O is positional (pread/pwrite), so there is no shared file
+// cursor and any number of threads may read through one VDIFile.
 struct VDIFile
 {
-    std::fstream file;
+    int fd = -1;
+    bool writable = false;
 
     // Info from the VDI header:
-    uint32_t signature = 0;   // at offset 0x40
-    uint32_t imageType = 0;   // at offset 0x4C
-    uint32_t mapOffset = 0;   // at offset 0x154
-    uint32_t frameOffset = 0; // at offset 0x158
-    uint32_t frameSize = 0;   // at offset 0x15C
-    uint64_t diskSize = 0;    // at offset 0x170
+    uint32_t signature = 0;       // at offset 0x40
+    uint32_t imageType = 0;       // at offset 0x4C
+    uint32_t mapOffset = 0;       // at offset 0x154
+    uint32_t frameOffset = 0;     // at offset 0x158
+    uint32_t frameSize = 0;       // at offset 0x15C
+    uint64_t diskSize = 0;        // at offset 0x170
+    uint32_t blockSize = 0;       // at offset 0x178
+    uint32_t blockExtra = 0;      // at offset 0x17C
+    uint32_t blocksInHdd = 0;     // at offset 0x180
+    uint32_t blocksAllocated = 0; // at offset 0x184
+
+    // Block map (virtual VDI block -> block index inside the image),
+    // loaded once at vdiOpen. Empty for fixed images, which are linear.
+    // Entries only change from FREE to allocated, under allocLock.
+    std::vector<uint32_t> blockMap;
+    std::mutex allocLock;
+
+    // Read-only view of the whole image when opened with useMmap.
+    // Blocks appended by vdiWrite after open lie past mappedSize.
+    const uint8_t *mapped = nullptr;
+    size_t mappedSize = 0;
 };
 
 // ------------------- 2) MBR Partition Structures ----------------------
@@ -107,6 +155,14 @@ struct Ext2Superblock
     uint16_t s_reserved_word_pad;
     uint32_t s_default_mount_options;
     uint32_t s_first_meta_bg;
+    uint32_t s_mkfs_time;
+    uint32_t s_jnl_blocks[17];
+    uint32_t s_blocks_count_hi;
+    uint32_t s_r_blocks_count_hi;
+    uint32_t s_free_blocks_count_hi;
+    uint16_t s_min_extra_isize;
+    uint16_t s_want_extra_isize;
+    uint32_t s_flags; // EXT2_FLAGS_*: signed/unsigned directory hash
 };
 #pragma pack(pop)
 
@@ -124,6 +180,259 @@ struct Ext2BlockGroupDescriptor
 };
 #pragma pack(pop)
 
+#pragma pack(push, 1)
+struct Inode
+{
+    uint16_t i_mode;
+    uint16_t i_uid;
+    uint32_t i_size;
+    uint32_t i_atime;
+    uint32_t i_ctime;
+    uint32_t i_mtime;
+    uint32_t i_dtime;
+    uint16_t i_gid;
+    uint16_t i_links_count;
+    uint32_t i_blocks;
+    uint32_t i_flags;
+    uint32_t i_osd1;
+    uint32_t i_block[15];
+    uint32_t i_generation;
+    uint32_t i_file_acl;
+    uint32_t i_dir_acl;
+    uint32_t i_faddr;
+    uint8_t i_osd2[12];
+};
+#pragma pack(pop)
+
+// Small LRU map: lookups move an entry to the front, the back is the
+// eviction candidate. Callers decide when to evict (and what to do with
+// the victim), so dirty entries can be written back first.
+template <typename K, typename V, typename Hash = std::hash<K>>
+struct LruMap
+{
+    typedef std::list<std::pair<K, V>> List;
+    size_t capacity = 0;
+    List order; // most recently used first
+    std::unordered_map<K, typename List::iterator, Hash> index;
+
+    V *find(const K &key)
+    {
+        auto it = index.find(key);
+        if (it == index.end())
+            return nullptr;
+        order.splice(order.begin(), order, it->second);
+        return &it->second->second;
+    }
+    V *peek(const K &key)
+    {
+        auto it = index.find(key);
+        return it == index.end() ? nullptr : &it->second->second;
+    }
+    V &insert(const K &key, V value)
+    {
+        order.emplace_front(key, std::move(value));
+        index[key] = order.begin();
+        return order.front().second;
+    }
+    void erase(const K &key)
+    {
+        auto it = index.find(key);
+        if (it == index.end())
+            return;
+        order.erase(it->second);
+        index.erase(it);
+    }
+    bool overFull() const { return order.size() > capacity; }
+    std::pair<K, V> &oldest() { return order.back(); }
+    void popOldest()
+    {
+        index.erase(order.back().first);
+        order.pop_back();
+    }
+    size_t size() const { return order.size(); }
+    void clear()
+    {
+        order.clear();
+        index.clear();
+    }
+};
+
+// Buffer cache keyed by physical ext2 block number. Writes are write-back:
+// ext2WriteBlock only marks the cached copy dirty, and dirty blocks reach
+// the image when evicted or on ext2FlushCache/ext2Close.
+struct CachedBlock
+{
+    std::vector<uint8_t> data;
+    bool dirty = false;
+};
+
+const size_t EXT2_DEFAULT_CACHE_BLOCKS = 1024;
+const size_t EXT2_DEFAULT_CACHE_INODES = 4096;
+const size_t EXT2_DEFAULT_CACHE_INDIRECT = 1024;
+const size_t EXT2_DEFAULT_CACHE_DENTRIES = 8192;
+
+// Write-back: dirty blocks are written all at once, sorted by block and
+// merged into one pwritev per contiguous run, when this many are dirty,
+// when the oldest has waited this long (checked as blocks are written),
+// when a dirty block is evicted, and on ext2FlushCache.
+const size_t EXT2_DEFAULT_DIRTY_BLOCKS = 256;
+const double EXT2_DEFAULT_DIRTY_EXPIRE = 5.0; // seconds
+
+struct BlockCache
+{
+    BlockCache() { blocks.capacity = EXT2_DEFAULT_CACHE_BLOCKS; }
+
+    LruMap<uint32_t, CachedBlock> blocks;
+    size_t dirtyCount = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t writebacks = 0; // blocks written back
+    uint64_t writeRuns = 0;  // write calls they took
+    uint64_t writeGen = 0;   // bumped by every cached write; see ext2ReadBlock
+
+    size_t dirtyLimit = EXT2_DEFAULT_DIRTY_BLOCKS;
+    double dirtyExpire = EXT2_DEFAULT_DIRTY_EXPIRE;
+    std::chrono::steady_clock::time_point dirtySince; // first dirtying since the last write-back
+    bool elevator = true; // false: one write per block, in LRU order (for comparison)
+    std::mutex lock;
+};
+
+// In-memory inodes keyed by inode number. writeInode only updates the
+// entry and marks it dirty; flushInodeCache then writes each affected
+// inode-table block once, however many of its inodes changed.
+struct CachedInode
+{
+    Inode inode;
+    bool dirty = false;
+};
+
+struct InodeCache
+{
+    InodeCache() { inodes.capacity = EXT2_DEFAULT_CACHE_INODES; }
+
+    LruMap<uint32_t, CachedInode> inodes;
+    size_t dirtyCount = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    std::mutex lock;
+};
+
+// Decoded indirect blocks. Each one is stored as runs of consecutive
+// entries that point at consecutive physical blocks, so a contiguous file
+// costs one run per indirect block instead of blockSize/4 pointers.
+// Keyed by the indirect block's own number; any write to that block
+// (ext2WriteBlock) drops the decoded copy.
+struct BlockRun
+{
+    uint32_t index;    // first entry in the indirect block
+    uint32_t physical; // block it points at, 0 for a run of holes
+    uint32_t len;      // number of entries
+};
+
+struct IndirectMapCache
+{
+    IndirectMapCache() { maps.capacity = EXT2_DEFAULT_CACHE_INDIRECT; }
+
+    LruMap<uint32_t, std::vector<BlockRun>> maps;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    std::mutex lock;
+};
+
+// Name lookups: (directory inode, name) -> child inode, with 0 recording
+// that the name is absent. Filled by lookupName; directory writes must
+// drop the entries they change (dcacheForget).
+struct DentryKey
+{
+    uint32_t parent;
+    std::string name;
+    bool operator==(const DentryKey &o) const { return parent == o.parent && name == o.name; }
+};
+
+struct DentryKeyHash
+{
+    size_t operator()(const DentryKey &k) const
+    {
+        return std::hash<std::string>()(k.name) ^ ((size_t)k.parent * 0x9E3779B97F4A7C15ULL);
+    }
+};
+
+struct DentryCache
+{
+    DentryCache() { entries.capacity = EXT2_DEFAULT_CACHE_DENTRIES; }
+
+    LruMap<DentryKey, uint32_t, DentryKeyHash> entries;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    std::mutex lock;
+};
+
+// Per-directory Bloom filters over entry names, so lookups of names that
+// are not there can be answered without reading the directory. Off until
+// setDirFilter enables them; built by the first full scan of a directory
+// and extended by addDirent. Removing an entry leaves its bits set, which
+// only costs a false positive.
+struct DirFilter
+{
+    std::vector<uint64_t> bits;
+    uint32_t hashes = 0;   // probes per name
+    uint32_t capacity = 0; // names it was sized for
+    uint32_t names = 0;
+};
+
+struct DirFilterCache
+{
+    LruMap<uint32_t, DirFilter> filters; // keyed by directory inode
+    double fpRate = 0.01;                // target false-positive rate
+    uint64_t queries = 0;
+    uint64_t rejected = 0;       // answered "absent" from the filter
+    uint64_t falsePositives = 0; // said "maybe", directory said no
+    std::mutex lock;
+};
+
+// Free space as extents of absolute block numbers, one pair of trees per
+// block group. byStart finds the extent around a goal block, byLen the
+// smallest extent of at least N blocks, both in O(log n). Built from the
+// block bitmaps by ext2Open and kept in step by allocateBlocks and
+// releaseBlocks; anything that edits a block bitmap directly must call
+// buildFreeExtentIndex again.
+struct GroupExtents
+{
+    std::map<uint32_t, uint32_t> byStart;          // start -> length
+    std::set<std::pair<uint32_t, uint32_t>> byLen; // (length, start)
+};
+
+struct FreeExtentIndex
+{
+    std::vector<GroupExtents> groups;
+    bool built = false; // false: allocateBlocks scans the bitmaps
+};
+
+// Reservation windows: a run of free blocks set aside (taken out of the
+// free-extent index, bitmaps untouched) ahead of a file's write cursor,
+// so its appends stay contiguous while other files are being written.
+// A window starts at s_prealloc_blocks (s_prealloc_dir_blocks for
+// directories; EXT2_DEFAULT_RESERVE_BLOCKS for files when it is 0) and
+// doubles each time sequential writes use it up.
+const uint32_t EXT2_DEFAULT_RESERVE_BLOCKS = 8;
+const uint32_t EXT2_MAX_RESERVE_BLOCKS = 1024;
+
+struct Reservation
+{
+    uint32_t start = 0; // first reserved block
+    uint32_t len = 0;   // blocks still reserved
+    uint32_t size = 0;  // current window size
+    uint32_t next = 0;  // block a sequential write would want next
+};
+
+struct ReservationTable
+{
+    std::unordered_map<uint32_t, Reservation> windows; // by inode
+    bool enabled = true; // needs the free-extent index
+    uint64_t used = 0;   // blocks handed out from a window
+    uint64_t refills = 0;
+};
+
 // This structure holds all data for “Step 3”
 struct Ext2File
 {
@@ -134,11 +443,88 @@ struct Ext2File
     uint32_t blockSize;      // 1024 << s_log_block_size
     uint32_t numBlockGroups; // # of block groups
     uint32_t inodeSize;
+
+    BlockCache cache;  // resize with ext2SetCacheSize, 0 disables it
+    InodeCache icache; // resize with setInodeCacheSize, 0 disables it
+    IndirectMapCache imap;
+    DentryCache dcache; // resize with setDentryCacheSize, 0 disables it
+    DirFilterCache dfilter;
+    FreeExtentIndex freeIndex;
+    ReservationTable rsv; // per-inode windows; releaseReservation on close
+
+    // free/used counters changed in memory since the last
+    // ext2SyncMetadata; one flag per block of the descriptor table
+    bool sbDirty = false;
+    std::vector<bool> bgdtDirty;
+
+    // allocateInodeFor / writeFileBlocks placement: Orlov-style spreading
+    // and group locality, or (false) plain first fit from group 0
+    bool localPlacement = true;
 };
 
 // ------------------- 4) VDI read logic (from your code) ---------------
+// Translates a virtual disk offset into an offset inside the image file.
+// `run` is clipped so that [diskOffset, diskOffset+run) stays inside one
+// VDI block. Returns -1 when that block is not allocated (reads as zeros).
+static int64_t vdiTranslate(const VDIFile &vdi, uint64_t diskOffset, size_t &run)
+{
+    if (vdi.blockMap.empty())
+    {
+        return (int64_t)(vdi.frameOffset + diskOffset);
+    }
+    uint64_t vblock = diskOffset / vdi.blockSize;
+    uint64_t inner = diskOffset % vdi.blockSize;
+    if (run > vdi.blockSize - inner)
+    {
+        run = (size_t)(vdi.blockSize - inner);
+    }
+    uint32_t entry = __atomic_load_n(&vdi.blockMap[vblock], __ATOMIC_ACQUIRE);
+    if (entry == VDI_BLOCK_FREE || entry == VDI_BLOCK_ZERO)
+    {
+        return -1;
+    }
+    return (int64_t)(vdi.frameOffset + (uint64_t)entry * (vdi.blockSize + vdi.blockExtra) +
+                     vdi.blockExtra + inner);
+}
+
+// pread/pwrite that retry on short transfers and EINTR. They return the
+// number of bytes moved, which is less than count only at EOF or on error.
+static size_t preadFull(int fd, void *buf, size_t count, uint64_t offset)
+{
+    size_t done = 0;
+    while (done < count)
+    {
+        ssize_t n = ::pread(fd, reinterpret_cast<uint8_t *>(buf) + done,
+                            count - done, (off_t)(offset + done));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += (size_t)n;
+    }
+    return done;
+}
+
+static size_t pwriteFull(int fd, const void *buf, size_t count, uint64_t offset)
+{
+    size_t done = 0;
+    while (done < count)
+    {
+        ssize_t n = ::pwrite(fd, reinterpret_cast<const uint8_t *>(buf) + done,
+                             count - done, (off_t)(offset + done));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += (size_t)n;
+    }
+    return done;
+}
+
 // STEP 0: vdiRead - Reads raw bytes from the virtual disk image (VDI).
-// accesses disk data from offset using VDI header info.
+// accesses disk data from offset using VDI header info. Dynamic images are
+// translated through the block map; unallocated blocks read as zeros
+// without touching the file.
 int64_t vdiRead(VDIFile &vdi, uint64_t diskOffset, void *buf, size_t count)
 {
     if (diskOffset >= vdi.diskSize)
@@ -148,24 +534,254 @@ int64_t vdiRead(VDIFile &vdi, uint64_t diskOffset, void *buf, size_t count)
     uint64_t remain = vdi.diskSize - diskOffset;
     size_t toRead = (count > remain) ? (size_t)remain : count;
 
-    uint64_t physical = (uint64_t)vdi.frameOffset + diskOffset;
+    uint8_t *out = reinterpret_cast<uint8_t *>(buf);
+    size_t done = 0;
+    while (done < toRead)
+    {
+        size_t run = toRead - done;
+        int64_t physical = vdiTranslate(vdi, diskOffset + done, run);
+        if (physical < 0)
+        {
+            std::memset(out + done, 0, run);
+            done += run;
+            continue;
+        }
+        if (vdi.mapped && (uint64_t)physical + run <= vdi.mappedSize)
+        {
+            std::memcpy(out + done, vdi.mapped + physical, run);
+            done += run;
+            continue;
+        }
+        size_t got = preadFull(vdi.fd, out + done, run, (uint64_t)physical);
+        done += got;
+        if (got < run)
+        {
+            return done > 0 ? (int64_t)done : -1;
+        }
+    }
+    return (int64_t)done;
+}
 
-    vdi.file.seekg((std::streamoff)physical, std::ios::beg);
-    if (!vdi.file.good())
+// preadv that retries on short transfers and EINTR. The iovec array is
+// consumed (advanced) as data arrives.
+static size_t preadvFull(int fd, std::vector<struct iovec> &iov, uint64_t offset)
+{
+    size_t done = 0;
+    size_t first = 0;
+    while (first < iov.size())
     {
-        return -1;
+        int cnt = (int)std::min<size_t>(iov.size() - first, IOV_MAX);
+        ssize_t n = ::preadv(fd, iov.data() + first, cnt, (off_t)(offset + done));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += (size_t)n;
+        size_t left = (size_t)n;
+        while (left > 0 && first < iov.size())
+        {
+            size_t take = std::min(left, iov[first].iov_len);
+            iov[first].iov_base = reinterpret_cast<uint8_t *>(iov[first].iov_base) + take;
+            iov[first].iov_len -= take;
+            left -= take;
+            if (iov[first].iov_len == 0)
+                first++;
+        }
+    }
+    return done;
+}
+
+static size_t pwritevFull(int fd, std::vector<struct iovec> &iov, uint64_t offset)
+{
+    size_t done = 0;
+    size_t first = 0;
+    while (first < iov.size())
+    {
+        int cnt = (int)std::min<size_t>(iov.size() - first, IOV_MAX);
+        ssize_t n = ::pwritev(fd, iov.data() + first, cnt, (off_t)(offset + done));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += (size_t)n;
+        size_t left = (size_t)n;
+        while (left > 0 && first < iov.size())
+        {
+            size_t take = std::min(left, iov[first].iov_len);
+            iov[first].iov_base = reinterpret_cast<uint8_t *>(iov[first].iov_base) + take;
+            iov[first].iov_len -= take;
+            left -= take;
+            if (iov[first].iov_len == 0)
+                first++;
+        }
+    }
+    return done;
+}
+
+// Scatter counterpart of vdiRead: fills the buffers in `iov` in order from
+// consecutive disk bytes starting at diskOffset. Each stretch that is
+// contiguous in the image file becomes one preadv. Returns the number of
+// bytes read, or -1 on error before any data arrived.
+int64_t vdiReadv(VDIFile &vdi, uint64_t diskOffset, const struct iovec *iov, int iovcnt)
+{
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        total += iov[i].iov_len;
+    }
+    if (diskOffset >= vdi.diskSize)
+    {
+        return 0;
+    }
+    if (total > vdi.diskSize - diskOffset)
+    {
+        total = (size_t)(vdi.diskSize - diskOffset);
+    }
+
+    int idx = 0;     // current caller buffer
+    size_t used = 0; // bytes of iov[idx] already filled
+    size_t done = 0;
+    std::vector<struct iovec> batch;
+    while (done < total)
+    {
+        // stretch [done, done+len) that sits contiguously in the image file
+        size_t len = total - done;
+        int64_t physical = vdiTranslate(vdi, diskOffset + done, len);
+        while (physical >= 0 && done + len < total)
+        {
+            size_t more = total - done - len;
+            if (vdiTranslate(vdi, diskOffset + done + len, more) != physical + (int64_t)len)
+                break;
+            len += more;
+        }
+
+        // slice the caller's buffers to cover the stretch
+        batch.clear();
+        for (size_t need = len; need > 0;)
+        {
+            size_t take = std::min(need, iov[idx].iov_len - used);
+            batch.push_back({reinterpret_cast<uint8_t *>(iov[idx].iov_base) + used, take});
+            need -= take;
+            used += take;
+            if (used == iov[idx].iov_len)
+            {
+                idx++;
+                used = 0;
+            }
+        }
+
+        if (physical < 0)
+        {
+            for (auto &v : batch)
+                std::memset(v.iov_base, 0, v.iov_len);
+        }
+        else if (vdi.mapped && (uint64_t)physical + len <= vdi.mappedSize)
+        {
+            const uint8_t *src = vdi.mapped + physical;
+            for (auto &v : batch)
+            {
+                std::memcpy(v.iov_base, src, v.iov_len);
+                src += v.iov_len;
+            }
+        }
+        else
+        {
+            size_t got = preadvFull(vdi.fd, batch, (uint64_t)physical);
+            if (got < len)
+            {
+                done += got;
+                return done > 0 ? (int64_t)done : -1;
+            }
+        }
+        done += len;
+    }
+    return (int64_t)done;
+}
+
+// Tells the kernel that [diskOffset, diskOffset+count) will be read soon
+// so it can start fetching it in the background. Sparse blocks are skipped.
+void vdiWillNeed(VDIFile &vdi, uint64_t diskOffset, size_t count)
+{
+    if (diskOffset >= vdi.diskSize)
+    {
+        return;
+    }
+    count = (size_t)std::min<uint64_t>(count, vdi.diskSize - diskOffset);
+    size_t done = 0;
+    while (done < count)
+    {
+        size_t run = count - done;
+        int64_t physical = vdiTranslate(vdi, diskOffset + done, run);
+        if (physical >= 0)
+        {
+            if (vdi.mapped && (uint64_t)physical + run <= vdi.mappedSize)
+            {
+                // madvise wants a page-aligned start
+                uintptr_t start = (uintptr_t)(vdi.mapped + physical);
+                uintptr_t page = (uintptr_t)::sysconf(_SC_PAGESIZE);
+                uintptr_t aligned = start & ~(page - 1);
+                ::madvise((void *)aligned, run + (start - aligned), MADV_WILLNEED);
+            }
+            else
+            {
+                ::posix_fadvise(vdi.fd, (off_t)physical, (off_t)run, POSIX_FADV_WILLNEED);
+            }
+        }
+        done += run;
+    }
+}
+
+// Returns a pointer straight into the mapped image for `count` bytes at
+// `diskOffset`, or nullptr when the image is not mapped or the range is
+// sparse, crosses a VDI block, or was allocated after the mapping was made.
+// Callers fall back to vdiRead in that case.
+const uint8_t *vdiPtr(const VDIFile &vdi, uint64_t diskOffset, size_t count)
+{
+    if (!vdi.mapped || diskOffset + count > vdi.diskSize)
+    {
+        return nullptr;
+    }
+    size_t run = count;
+    int64_t physical = vdiTranslate(vdi, diskOffset, run);
+    if (physical < 0 || run < count || (uint64_t)physical + count > vdi.mappedSize)
+    {
+        return nullptr;
     }
-    vdi.file.read(reinterpret_cast<char *>(buf), toRead);
-    return vdi.file.gcount();
+    return vdi.mapped + physical;
+}
+
+// Maps the whole image read-only. pwrite through the same file is
+// coherent with a MAP_SHARED view, so writes need no extra flushing.
+static bool vdiMap(VDIFile &vdi)
+{
+    off_t size = ::lseek(vdi.fd, 0, SEEK_END);
+    if (size <= 0)
+    {
+        return false;
+    }
+    void *p = ::mmap(nullptr, (size_t)size, PROT_READ, MAP_SHARED, vdi.fd, 0);
+    if (p == MAP_FAILED)
+    {
+        return false;
+    }
+    vdi.mapped = reinterpret_cast<const uint8_t *>(p);
+    vdi.mappedSize = (size_t)size;
+    return true;
 }
 
 // STEP 0: vdiOpen - Opens a VDI file and parses the header fields.
-// Retrieves offsets and disk structure.
+// Retrieves offsets and disk structure. With useMmap the image is also
+// mapped so block reads can be served without syscalls or copies.
 
-bool vdiOpen(VDIFile &vdi, const std::string &filename)
+bool vdiOpen(VDIFile &vdi, const std::string &filename, bool useMmap = false)
 {
-    vdi.file.open(filename, std::ios::in | std::ios::binary);
-    if (!vdi.file.is_open())
+    vdi.fd = ::open(filename.c_str(), O_RDWR);
+    vdi.writable = (vdi.fd >= 0);
+    if (!vdi.writable)
+    {
+        vdi.fd = ::open(filename.c_str(), O_RDONLY);
+    }
+    if (vdi.fd < 0)
     {
         std::cerr << "Could not open VDI file '" << filename << "'\n";
         return false;
@@ -174,9 +790,7 @@ bool vdiOpen(VDIFile &vdi, const std::string &filename)
     // read first 400 bytes
     VDIHeader hdr;
     std::memset(&hdr, 0, sizeof(hdr));
-    vdi.file.seekg(0, std::ios::beg);
-    vdi.file.read(reinterpret_cast<char *>(&hdr), sizeof(hdr));
-    if (!vdi.file.good())
+    if (preadFull(vdi.fd, &hdr, sizeof(hdr), 0) < sizeof(hdr))
     {
         std::cerr << "Error reading VDI header.\n";
         return false;
@@ -188,6 +802,30 @@ bool vdiOpen(VDIFile &vdi, const std::string &filename)
     vdi.frameOffset = *reinterpret_cast<const uint32_t *>(&hdr.data[0x158]);
     vdi.frameSize = *reinterpret_cast<const uint32_t *>(&hdr.data[0x15C]);
     vdi.diskSize = *reinterpret_cast<const uint64_t *>(&hdr.data[0x170]);
+    vdi.blockSize = *reinterpret_cast<const uint32_t *>(&hdr.data[0x178]);
+    vdi.blockExtra = *reinterpret_cast<const uint32_t *>(&hdr.data[0x17C]);
+    vdi.blocksInHdd = *reinterpret_cast<const uint32_t *>(&hdr.data[0x180]);
+    vdi.blocksAllocated = *reinterpret_cast<const uint32_t *>(&hdr.data[0x184]);
+
+    // Dynamic images keep a uint32 per VDI block at mapOffset. Load it once
+    // here so every later read is a table lookup instead of a header walk.
+    vdi.blockMap.clear();
+    if (vdi.imageType == VDI_TYPE_DYNAMIC)
+    {
+        if (vdi.blockSize == 0 ||
+            (uint64_t)vdi.blocksInHdd * vdi.blockSize < vdi.diskSize)
+        {
+            std::cerr << "Bad block map geometry in VDI header.\n";
+            return false;
+        }
+        vdi.blockMap.resize(vdi.blocksInHdd);
+        size_t mapBytes = (size_t)vdi.blocksInHdd * sizeof(uint32_t);
+        if (preadFull(vdi.fd, vdi.blockMap.data(), mapBytes, vdi.mapOffset) < mapBytes)
+        {
+            std::cerr << "Error reading VDI block map.\n";
+            return false;
+        }
+    }
 
     // Debugging to show some bytes
     std::cout << "\n[DEBUG] Bytes at 0x150..0x15F:\n  ";
@@ -206,15 +844,27 @@ bool vdiOpen(VDIFile &vdi, const std::string &filename)
     std::cout << "[DEBUG] diskSize: 0x" << std::hex << vdi.diskSize
               << "  (" << std::dec << vdi.diskSize << " bytes)\n\n";
 
+    if (useMmap && !vdiMap(vdi))
+    {
+        std::cerr << "mmap failed, falling back to stream reads\n";
+    }
+
     return true;
 }
 
 // STEP 0: vdiClose - Closes the opened VDI file stream.
 void vdiClose(VDIFile &vdi)
 {
-    if (vdi.file.is_open())
+    if (vdi.mapped)
+    {
+        ::munmap(const_cast<uint8_t *>(vdi.mapped), vdi.mappedSize);
+        vdi.mapped = nullptr;
+        vdi.mappedSize = 0;
+    }
+    if (vdi.fd >= 0)
     {
-        vdi.file.close();
+        ::close(vdi.fd);
+        vdi.fd = -1;
     }
 }
 
@@ -318,20 +968,13 @@ static int64_t mbrRead(MBRPartition &mp, void *buf, size_t count)
     }
     return got;
 }
-static bool mbrSeek(MBRPartition &mp, int64_t offset)
-{
-    if (offset < 0 || (uint64_t)offset > mp.sizeBytes)
-    {
-        return false;
-    }
-    mp.cursor = offset;
-    return true;
-}
+
+int64_t mbrWriteAt(MBRPartition &mp, uint64_t offset, const void *buf, size_t count);
+int64_t vdiWritev(VDIFile &vdi, uint64_t diskOffset, const struct iovec *iov, int iovcnt);
 
 // ------------------- 6) Step 3: ext2 read block + superblock
-// STEP 3: ext2ReadBlock - Reads a file system block using EXT2's block layout.
-// Supports block-based I/O from virtual disk partition.
-bool ext2ReadBlock(Ext2File &ext2, uint32_t blockIndex, void *buf)
+// Reads one block straight from the image, bypassing the cache.
+static bool ext2ReadBlockRaw(Ext2File &ext2, uint32_t blockIndex, void *buf)
 {
     // offset in partition:
     uint64_t offset = (uint64_t)blockIndex * ext2.blockSize;
@@ -348,14 +991,7 @@ bool ext2ReadBlock(Ext2File &ext2, uint32_t blockIndex, void *buf)
         std::memset(buf, 0, ext2.blockSize);
         return false;
     }
-    vdi.file.seekg((std::streamoff)(vdi.frameOffset + diskOffset), std::ios::beg);
-    if (!vdi.file.good())
-    {
-        std::memset(buf, 0, ext2.blockSize);
-        return false;
-    }
-    vdi.file.read(reinterpret_cast<char *>(buf), ext2.blockSize);
-    if (vdi.file.gcount() < (std::streamsize)ext2.blockSize)
+    if (vdiRead(vdi, diskOffset, buf, ext2.blockSize) < (int64_t)ext2.blockSize)
     {
         std::memset(buf, 0, ext2.blockSize);
         return false;
@@ -363,35 +999,447 @@ bool ext2ReadBlock(Ext2File &ext2, uint32_t blockIndex, void *buf)
     return true;
 }
 
-// STEP 2: ext2LoadSuperblock - Reads and validates the EXT2 superblock.
-// Extracts fields like s_inodes_count, s_blocks_count.
-bool ext2LoadSuperblock(Ext2File &ext2)
+static bool ext2WriteBlockRaw(Ext2File &ext2, uint32_t blockIndex, const void *buf)
 {
-    // Always at offset 1024 from the start of the partition
-    if (1024 + 1024 > ext2.part->sizeBytes)
-    {
-        std::cerr << "Partition too small for superblock\n";
-        return false;
-    }
-    VDIFile &vdi = *ext2.part->vdi;
-    uint64_t diskOffset = ext2.part->startByte + 1024ULL;
-    if (diskOffset + 1024 > vdi.diskSize)
+    return mbrWriteAt(*ext2.part, (uint64_t)blockIndex * ext2.blockSize, buf, ext2.blockSize) ==
+           (int64_t)ext2.blockSize;
+}
+
+// Writes every dirty block back in block order, one vdiWritev per run
+// of consecutive blocks, and marks the written ones clean. A block whose
+// write fails stays dirty. Caller holds cache.lock.
+static bool ext2WriteBack(Ext2File &ext2)
+{
+    BlockCache &c = ext2.cache;
+    std::vector<std::pair<uint32_t, CachedBlock *>> dirty;
+    dirty.reserve(c.dirtyCount);
+    for (auto &entry : c.blocks.order)
     {
-        std::cerr << "Disk too small for superblock\n";
-        return false;
+        if (entry.second.dirty)
+            dirty.push_back({entry.first, &entry.second});
     }
-    uint8_t buf[1024];
-    std::memset(buf, 0, sizeof(buf));
-    vdi.file.seekg((std::streamoff)(vdi.frameOffset + diskOffset), std::ios::beg);
-    if (!vdi.file.good())
+    if (!c.elevator)
     {
-        std::cerr << "Error seeking superblock\n";
-        return false;
+        bool ok = true;
+        for (auto &d : dirty)
+        {
+            if (!ext2WriteBlockRaw(ext2, d.first, d.second->data.data()))
+            {
+                ok = false;
+                continue;
+            }
+            d.second->dirty = false;
+            c.dirtyCount--;
+            c.writebacks++;
+            c.writeRuns++;
+        }
+        return ok;
     }
-    vdi.file.read(reinterpret_cast<char *>(buf), 1024);
-    if (vdi.file.gcount() < 1024)
+
+    std::sort(dirty.begin(), dirty.end(),
+              [](const std::pair<uint32_t, CachedBlock *> &a, const std::pair<uint32_t, CachedBlock *> &b)
+              { return a.first < b.first; });
+    bool ok = true;
+    std::vector<struct iovec> iov;
+    for (size_t i = 0; i < dirty.size();)
     {
-        std::cerr << "Partial read superblock\n";
+        size_t j = i;
+        iov.clear();
+        do
+        {
+            iov.push_back({dirty[j].second->data.data(), ext2.blockSize});
+            j++;
+        } while (j < dirty.size() && dirty[j].first == dirty[j - 1].first + 1 && iov.size() < IOV_MAX);
+        uint64_t offset = (uint64_t)dirty[i].first * ext2.blockSize;
+        size_t bytes = (j - i) * (size_t)ext2.blockSize;
+        if (offset + bytes <= ext2.part->sizeBytes &&
+            vdiWritev(*ext2.part->vdi, ext2.part->startByte + offset, iov.data(), (int)iov.size()) ==
+                (int64_t)bytes)
+        {
+            for (; i < j; i++)
+                dirty[i].second->dirty = false;
+            c.dirtyCount -= iov.size();
+            c.writebacks += iov.size();
+            c.writeRuns++;
+            continue;
+        }
+        // the run failed as a whole; retry its blocks one by one so only
+        // the ones that really cannot be written stay dirty
+        for (; i < j; i++)
+        {
+            if (!ext2WriteBlockRaw(ext2, dirty[i].first, dirty[i].second->data.data()))
+            {
+                ok = false;
+                continue;
+            }
+            dirty[i].second->dirty = false;
+            c.dirtyCount--;
+            c.writebacks++;
+            c.writeRuns++;
+        }
+    }
+    return ok;
+}
+
+// Drops least recently used blocks until the cache fits its capacity,
+// writing dirty ones back first (all of them, in one sorted pass, rather
+// than the victim alone). A victim that cannot be written is kept and the
+// cache is left over capacity rather than lose the data. Caller holds
+// cache.lock.
+static void ext2CacheTrim(Ext2File &ext2)
+{
+    BlockCache &c = ext2.cache;
+    while (c.blocks.overFull())
+    {
+        auto &victim = c.blocks.oldest();
+        if (victim.second.dirty && c.elevator)
+        {
+            ext2WriteBack(ext2);
+        }
+        else if (victim.second.dirty &&
+                 ext2WriteBlockRaw(ext2, victim.first, victim.second.data.data()))
+        {
+            victim.second.dirty = false;
+            c.writebacks++;
+            c.writeRuns++;
+            c.dirtyCount--;
+        }
+        if (victim.second.dirty)
+        {
+            std::cerr << "ext2CacheTrim: cannot write back block " << victim.first
+                      << ", keeping it cached\n";
+            return;
+        }
+        c.blocks.popOldest();
+    }
+}
+
+// STEP 3: ext2ReadBlock - Reads a file system block using EXT2's block layout.
+// Supports block-based I/O from virtual disk partition. Blocks are served
+// from the buffer cache when present and added to it after a miss.
+bool ext2ReadBlock(Ext2File &ext2, uint32_t blockIndex, void *buf)
+{
+    BlockCache &c = ext2.cache;
+    if (c.blocks.capacity == 0)
+    {
+        return ext2ReadBlockRaw(ext2, blockIndex, buf);
+    }
+    uint64_t gen;
+    {
+        std::lock_guard<std::mutex> lock(c.lock);
+        if (CachedBlock *cb = c.blocks.find(blockIndex))
+        {
+            c.hits++;
+            std::memcpy(buf, cb->data.data(), ext2.blockSize);
+            return true;
+        }
+        c.misses++;
+        gen = c.writeGen;
+    }
+
+    // read without holding the lock so other threads are not stalled
+    if (!ext2ReadBlockRaw(ext2, blockIndex, buf))
+    {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(c.lock);
+    if (CachedBlock *cb = c.blocks.peek(blockIndex))
+    {
+        // someone cached (and maybe dirtied) it meanwhile; theirs wins
+        std::memcpy(buf, cb->data.data(), ext2.blockSize);
+        return true;
+    }
+    if (c.writeGen != gen)
+    {
+        // a write, its write-back and the eviction may all have happened
+        // during the unlocked read, so `buf` can predate them. With the
+        // lock held nothing can change the block on the image.
+        if (!ext2ReadBlockRaw(ext2, blockIndex, buf))
+        {
+            return false;
+        }
+    }
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(buf);
+    CachedBlock cb;
+    cb.data.assign(bytes, bytes + ext2.blockSize);
+    c.blocks.insert(blockIndex, std::move(cb));
+    ext2CacheTrim(ext2);
+    return true;
+}
+
+// Writes a whole block. With the cache on, this only updates the cached
+// copy and marks it dirty; the image is written on eviction or flush.
+bool ext2WriteBlock(Ext2File &ext2, uint32_t blockIndex, const void *buf)
+{
+    {
+        // if this is an indirect block, its decoded runs are now stale
+        std::lock_guard<std::mutex> lock(ext2.imap.lock);
+        ext2.imap.maps.erase(blockIndex);
+    }
+    BlockCache &c = ext2.cache;
+    if (c.blocks.capacity == 0)
+    {
+        return ext2WriteBlockRaw(ext2, blockIndex, buf);
+    }
+    if ((uint64_t)(blockIndex + 1) * ext2.blockSize > ext2.part->sizeBytes)
+    {
+        return false;
+    }
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(buf);
+    std::lock_guard<std::mutex> lock(c.lock);
+    CachedBlock *cb = c.blocks.find(blockIndex);
+    if (!cb)
+    {
+        cb = &c.blocks.insert(blockIndex, CachedBlock());
+    }
+    cb->data.assign(bytes, bytes + ext2.blockSize);
+    c.writeGen++;
+    if (!cb->dirty)
+    {
+        cb->dirty = true;
+        if (c.dirtyCount++ == 0)
+        {
+            c.dirtySince = std::chrono::steady_clock::now();
+        }
+    }
+    if (c.elevator &&
+        (c.dirtyCount >= c.dirtyLimit ||
+         std::chrono::duration<double>(std::chrono::steady_clock::now() - c.dirtySince).count() >= c.dirtyExpire))
+    {
+        ext2WriteBack(ext2);
+    }
+    ext2CacheTrim(ext2);
+    return true;
+}
+
+// Copies the cached copy of a dirty block over `buf`. Used by readers that
+// go around the cache (async and bulk reads) so they still see
+// unflushed writes. Returns true if `buf` was patched.
+bool ext2CacheOverlay(Ext2File &ext2, uint32_t blockIndex, void *buf)
+{
+    BlockCache &c = ext2.cache;
+    if (__atomic_load_n(&c.dirtyCount, __ATOMIC_RELAXED) == 0)
+    {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(c.lock);
+    CachedBlock *cb = c.blocks.peek(blockIndex);
+    if (!cb || !cb->dirty)
+    {
+        return false;
+    }
+    std::memcpy(buf, cb->data.data(), ext2.blockSize);
+    return true;
+}
+
+// Writes every dirty block back to the image. Blocks stay cached, clean.
+bool ext2FlushCache(Ext2File &ext2)
+{
+    std::lock_guard<std::mutex> lock(ext2.cache.lock);
+    return ext2WriteBack(ext2);
+}
+
+// Sets the write-back triggers: write all dirty blocks once `dirtyBlocks`
+// are dirty or the oldest has been dirty for `expireSeconds`.
+void ext2SetWriteback(Ext2File &ext2, size_t dirtyBlocks, double expireSeconds)
+{
+    std::lock_guard<std::mutex> lock(ext2.cache.lock);
+    ext2.cache.dirtyLimit = std::max<size_t>(1, dirtyBlocks);
+    ext2.cache.dirtyExpire = expireSeconds;
+}
+
+// Resizes the cache (in blocks); 0 flushes and disables it.
+void ext2SetCacheSize(Ext2File &ext2, size_t blocks)
+{
+    std::lock_guard<std::mutex> lock(ext2.cache.lock);
+    ext2.cache.blocks.capacity = blocks;
+    ext2CacheTrim(ext2);
+}
+
+void printCacheStats(const Ext2File &ext2)
+{
+    const BlockCache &c = ext2.cache;
+    uint64_t total = c.hits + c.misses;
+    std::cout << "Block cache: " << c.blocks.size() << "/" << c.blocks.capacity << " blocks, "
+              << c.hits << " hits, " << c.misses << " misses";
+    if (total)
+        std::cout << " (" << std::fixed << std::setprecision(1) << 100.0 * c.hits / total
+                  << "% hit rate)" << std::defaultfloat;
+    std::cout << ", " << c.writebacks << " write-backs in " << c.writeRuns << " writes\n";
+    const InodeCache &ic = ext2.icache;
+    std::cout << "Inode cache: " << ic.inodes.size() << "/" << ic.inodes.capacity << " inodes, "
+              << ic.hits << " hits, " << ic.misses << " misses, " << ic.dirtyCount << " dirty\n";
+    const IndirectMapCache &mc = ext2.imap;
+    std::cout << "Indirect map cache: " << mc.maps.size() << "/" << mc.maps.capacity << " blocks, "
+              << mc.hits << " hits, " << mc.misses << " misses\n";
+    const DentryCache &dc = ext2.dcache;
+    std::cout << "Dentry cache: " << dc.entries.size() << "/" << dc.entries.capacity << " names, "
+              << dc.hits << " hits, " << dc.misses << " misses\n";
+    const DirFilterCache &df = ext2.dfilter;
+    if (df.filters.capacity > 0)
+    {
+        size_t bytes = 0, names = 0;
+        for (const auto &f : df.filters.order)
+        {
+            bytes += f.second.bits.size() * sizeof(uint64_t);
+            names += f.second.names;
+        }
+        std::cout << "Dir filters: " << df.filters.size() << "/" << df.filters.capacity << " dirs, "
+                  << names << " names, " << bytes << " bytes";
+        if (names)
+            std::cout << " (" << std::fixed << std::setprecision(1) << 8.0 * bytes / names
+                      << " bits/name)" << std::defaultfloat;
+        std::cout << ", target fp " << df.fpRate << ", " << df.queries << " queries, "
+                  << df.rejected << " rejected, " << df.falsePositives << " false positives";
+        if (df.rejected + df.falsePositives)
+            std::cout << " (" << std::fixed << std::setprecision(2)
+                      << 100.0 * df.falsePositives / (df.rejected + df.falsePositives)
+                      << "% of absent names)" << std::defaultfloat;
+        std::cout << "\n";
+    }
+}
+
+// Zero-copy variant of ext2ReadBlock: a pointer to the block inside the
+// mapped image, or nullptr if the caller has to use ext2ReadBlock instead
+// (including when the cache holds a newer, dirty copy).
+const uint8_t *ext2BlockPtr(Ext2File &ext2, uint32_t blockIndex)
+{
+    uint64_t offset = (uint64_t)blockIndex * ext2.blockSize;
+    if (!ext2.part->vdi->mapped || offset + ext2.blockSize > ext2.part->sizeBytes)
+    {
+        return nullptr;
+    }
+    if (__atomic_load_n(&ext2.cache.dirtyCount, __ATOMIC_RELAXED) != 0)
+    {
+        std::lock_guard<std::mutex> lock(ext2.cache.lock);
+        CachedBlock *cb = ext2.cache.blocks.peek(blockIndex);
+        if (cb && cb->dirty)
+        {
+            return nullptr;
+        }
+    }
+    return vdiPtr(*ext2.part->vdi, ext2.part->startByte + offset, ext2.blockSize);
+}
+
+// Reads `count` consecutive blocks with a single image read (split only
+// at VDI block boundaries), then patches in any blocks that are dirty in
+// the cache. Meant for bulk scans that should not churn the cache.
+bool ext2ReadBlocks(Ext2File &ext2, uint32_t first, uint32_t count, void *buf)
+{
+    uint64_t offset = (uint64_t)first * ext2.blockSize;
+    size_t bytes = (size_t)count * ext2.blockSize;
+    if (offset + bytes > ext2.part->sizeBytes)
+    {
+        std::memset(buf, 0, bytes);
+        return false;
+    }
+    if (vdiRead(*ext2.part->vdi, ext2.part->startByte + offset, buf, bytes) < (int64_t)bytes)
+    {
+        std::memset(buf, 0, bytes);
+        return false;
+    }
+    if (__atomic_load_n(&ext2.cache.dirtyCount, __ATOMIC_RELAXED) != 0)
+    {
+        uint8_t *out = reinterpret_cast<uint8_t *>(buf);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            ext2CacheOverlay(ext2, first + i, out + (size_t)i * ext2.blockSize);
+        }
+    }
+    return true;
+}
+
+// Reads `count` consecutive blocks into separate buffers (bufs[i] gets
+// block first+i) with as few preadv calls as the image layout allows.
+bool ext2ReadBlocksv(Ext2File &ext2, uint32_t first, uint32_t count, uint8_t *const *bufs)
+{
+    uint64_t offset = (uint64_t)first * ext2.blockSize;
+    size_t bytes = (size_t)count * ext2.blockSize;
+    std::vector<struct iovec> iov;
+    iov.reserve(count);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        // adjacent destinations collapse into one iovec
+        if (!iov.empty() && reinterpret_cast<uint8_t *>(iov.back().iov_base) + iov.back().iov_len == bufs[i])
+            iov.back().iov_len += ext2.blockSize;
+        else
+            iov.push_back({bufs[i], ext2.blockSize});
+    }
+    bool ok = offset + bytes <= ext2.part->sizeBytes &&
+              vdiReadv(*ext2.part->vdi, ext2.part->startByte + offset, iov.data(), (int)iov.size()) == (int64_t)bytes;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (!ok)
+            std::memset(bufs[i], 0, ext2.blockSize);
+        else if (__atomic_load_n(&ext2.cache.dirtyCount, __ATOMIC_RELAXED) != 0)
+            ext2CacheOverlay(ext2, first + i, bufs[i]);
+    }
+    return ok;
+}
+
+// Starts kernel read-ahead for `count` blocks at `first`.
+void ext2WillNeed(Ext2File &ext2, uint32_t first, uint32_t count)
+{
+    uint64_t offset = (uint64_t)first * ext2.blockSize;
+    uint64_t bytes = (uint64_t)count * ext2.blockSize;
+    if (offset + bytes <= ext2.part->sizeBytes)
+    {
+        vdiWillNeed(*ext2.part->vdi, ext2.part->startByte + offset, (size_t)bytes);
+    }
+}
+
+// Copies `len` bytes at `offset` inside a block, without staging the whole
+// block in a temporary buffer when it is cached or mapped.
+bool ext2ReadPartial(Ext2File &ext2, uint32_t blockIndex, uint32_t offset, void *out, size_t len)
+{
+    BlockCache &c = ext2.cache;
+    if (c.blocks.capacity > 0)
+    {
+        std::lock_guard<std::mutex> lock(c.lock);
+        if (CachedBlock *cb = c.blocks.find(blockIndex))
+        {
+            c.hits++;
+            std::memcpy(out, cb->data.data() + offset, len);
+            return true;
+        }
+    }
+    if (const uint8_t *p = ext2BlockPtr(ext2, blockIndex))
+    {
+        std::memcpy(out, p + offset, len);
+        return true;
+    }
+    thread_local std::vector<uint8_t> scratch;
+    scratch.resize(ext2.blockSize);
+    if (!ext2ReadBlock(ext2, blockIndex, scratch.data()))
+    {
+        return false;
+    }
+    std::memcpy(out, scratch.data() + offset, len);
+    return true;
+}
+
+// STEP 2: ext2LoadSuperblock - Reads and validates the EXT2 superblock.
+// Extracts fields like s_inodes_count, s_blocks_count.
+bool ext2LoadSuperblock(Ext2File &ext2)
+{
+    // Always at offset 1024 from the start of the partition
+    if (1024 + 1024 > ext2.part->sizeBytes)
+    {
+        std::cerr << "Partition too small for superblock\n";
+        return false;
+    }
+    VDIFile &vdi = *ext2.part->vdi;
+    uint64_t diskOffset = ext2.part->startByte + 1024ULL;
+    if (diskOffset + 1024 > vdi.diskSize)
+    {
+        std::cerr << "Disk too small for superblock\n";
+        return false;
+    }
+    uint8_t buf[1024];
+    std::memset(buf, 0, sizeof(buf));
+    if (vdiRead(vdi, diskOffset, buf, 1024) < 1024)
+    {
+        std::cerr << "Partial read superblock\n";
         return false;
     }
 
@@ -432,6 +1480,8 @@ bool ext2LoadBGDT(Ext2File &ext2)
     size_t blocksNeeded = (totalBytes + ext2.blockSize - 1) / ext2.blockSize;
 
     ext2.bgdt.resize(ext2.numBlockGroups);
+    ext2.bgdtDirty.assign(blocksNeeded, false);
+    ext2.sbDirty = false;
 
     std::vector<uint8_t> blockBuf(ext2.blockSize, 0);
     size_t bytesCopied = 0;
@@ -454,9 +1504,12 @@ bool ext2LoadBGDT(Ext2File &ext2)
     return true;
 }
 
+bool buildFreeExtentIndex(Ext2File *fs);
+
 bool ext2Open(Ext2File &ext2, MBRPartition &part)
 {
     ext2.part = &part;
+
     if (!ext2LoadSuperblock(ext2))
     {
         return false;
@@ -465,11 +1518,109 @@ bool ext2Open(Ext2File &ext2, MBRPartition &part)
     {
         return false;
     }
+    // without the index, allocation falls back to scanning the bitmaps
+    buildFreeExtentIndex(&ext2);
     return true;
 }
-void ext2Close(Ext2File & /*ext2*/)
+int flushInodeCache(Ext2File *fs);
+
+// True if group g carries a backup of the superblock and descriptor table
+// (every group, or with sparse_super only 0, 1 and powers of 3, 5 and 7).
+static bool groupHasSuperBackup(const Ext2File &ext2, uint32_t g)
+{
+    if (g <= 1 || !(ext2.sb.s_feature_ro_compat & 0x0001))
+    {
+        return true;
+    }
+    for (uint32_t base : {3u, 5u, 7u})
+    {
+        uint64_t p = base;
+        while (p < g)
+        {
+            p *= base;
+        }
+        if (p == g)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Writes the superblock and the dirty descriptor-table blocks, the
+// primary copies and every backup, in one pass through the block cache.
+// Allocation only updates the in-memory counters, so this is where they
+// reach the disk (ext2Close calls it; so does ext2Sync).
+bool ext2SyncMetadata(Ext2File &ext2)
+{
+    if (!ext2.sbDirty)
+    {
+        return true;
+    }
+    ext2.sb.s_wtime = (uint32_t)std::time(nullptr);
+    uint32_t bs = ext2.blockSize;
+    size_t descPerBlock = bs / sizeof(Ext2BlockGroupDescriptor);
+    std::vector<uint8_t> buf(bs);
+    bool ok = true;
+    for (uint32_t g = 0; g < ext2.numBlockGroups; g++)
+    {
+        if (!groupHasSuperBackup(ext2, g))
+        {
+            continue;
+        }
+        // the primary superblock sits 1024 bytes into the partition,
+        // which is block 1 or the middle of block 0; backups start their
+        // group's first block
+        uint32_t sbBlock = ext2.sb.s_first_data_block + g * ext2.sb.s_blocks_per_group;
+        uint32_t sbOffset = (g == 0) ? 1024 % bs : 0;
+        Ext2Superblock copy = ext2.sb;
+        copy.s_block_group_nr = (uint16_t)g;
+        ok = ext2ReadBlock(ext2, sbBlock, buf.data()) && ok;
+        std::memcpy(buf.data() + sbOffset, &copy, sizeof(copy));
+        ok = ext2WriteBlock(ext2, sbBlock, buf.data()) && ok;
+
+        for (size_t b = 0; b < ext2.bgdtDirty.size(); b++)
+        {
+            if (!ext2.bgdtDirty[b])
+            {
+                continue;
+            }
+            size_t firstDesc = b * descPerBlock;
+            size_t n = std::min(descPerBlock, ext2.bgdt.size() - firstDesc);
+            uint32_t blockNum = sbBlock + 1 + (uint32_t)b;
+            ok = ext2ReadBlock(ext2, blockNum, buf.data()) && ok;
+            std::memcpy(buf.data(), &ext2.bgdt[firstDesc], n * sizeof(Ext2BlockGroupDescriptor));
+            ok = ext2WriteBlock(ext2, blockNum, buf.data()) && ok;
+        }
+    }
+    std::fill(ext2.bgdtDirty.begin(), ext2.bgdtDirty.end(), false);
+    ext2.sbDirty = false;
+    return ok;
+}
+
+// Writes everything held in memory back to the image: cached inodes,
+// superblock and descriptor counters, then the dirty blocks.
+bool ext2Sync(Ext2File &ext2)
+{
+    bool ok = flushInodeCache(&ext2) == 0;
+    ok = ext2SyncMetadata(ext2) && ok;
+    return ext2FlushCache(ext2) && ok;
+}
+
+void ext2Close(Ext2File &ext2)
 {
-    // vector will free automatically, no dynamic alloc
+    // write back anything still dirty; vectors free themselves
+    flushInodeCache(&ext2);
+    ext2SyncMetadata(ext2);
+    ext2.icache.inodes.clear();
+    ext2.imap.maps.clear();
+    ext2.dcache.entries.clear();
+    ext2.dfilter.filters.clear();
+    ext2.rsv.windows.clear();
+    ext2.freeIndex.groups.clear();
+    ext2.freeIndex.built = false;
+    ext2FlushCache(ext2);
+    ext2.cache.blocks.clear();
 }
 
 // -------------- 7) Printing debug info for Step 3 ---------------------
@@ -583,74 +1734,205 @@ void printExtendedSuperblockInfo(const Ext2Superblock &sb)
 }
 
 // --------------------------- STEP 4 ADDITIONS ---------------------------
+// (struct Inode lives with the other on-disk structures in section 3)
 
-#pragma pack(push, 1)
-struct Inode
-{
-    uint16_t i_mode;
-    uint16_t i_uid;
-    uint32_t i_size;
-    uint32_t i_atime;
-    uint32_t i_ctime;
-    uint32_t i_mtime;
-    uint32_t i_dtime;
-    uint16_t i_gid;
-    uint16_t i_links_count;
-    uint32_t i_blocks;
-    uint32_t i_flags;
-    uint32_t i_osd1;
-    uint32_t i_block[15];
-    uint32_t i_generation;
-    uint32_t i_file_acl;
-    uint32_t i_dir_acl;
-    uint32_t i_faddr;
-    uint8_t i_osd2[12];
-};
-#pragma pack(pop)
-
-// STEP 4: fetchInode - Retrieves a specific inode from disk.
-// Implements inode location logic described in step4.pdf.
-int fetchInode(Ext2File *fs, uint32_t iNum, Inode *inode)
+// Finds the inode-table block holding inode iNum and its byte offset there.
+static void inodeLocation(Ext2File *fs, uint32_t iNum, uint32_t &blockNum, uint32_t &offset)
 {
-    if (iNum == 0 || iNum > fs->sb.s_inodes_count)
-        return -1;
     uint32_t group = (iNum - 1) / fs->sb.s_inodes_per_group;
     uint32_t index = (iNum - 1) % fs->sb.s_inodes_per_group;
     uint32_t inodesPerBlock = fs->blockSize / fs->inodeSize;
-    uint32_t blockIndex = index / inodesPerBlock;
-    uint32_t offset = (index % inodesPerBlock) * fs->inodeSize;
-    uint32_t blockNum = fs->bgdt[group].bg_inode_table + blockIndex;
+    blockNum = fs->bgdt[group].bg_inode_table + index / inodesPerBlock;
+    offset = (index % inodesPerBlock) * fs->inodeSize;
+}
+
+// Writes one inode into its inode-table block (read-modify-write through
+// the block cache).
+static int storeInode(Ext2File *fs, uint32_t iNum, const Inode *inode)
+{
+    uint32_t blockNum, byteOffset;
+    inodeLocation(fs, iNum, blockNum, byteOffset);
     std::vector<uint8_t> buf(fs->blockSize);
     if (!ext2ReadBlock(*fs, blockNum, buf.data()))
         return -1;
-    memcpy(inode, buf.data() + offset, sizeof(Inode));
-    return 0;
+    std::memcpy(buf.data() + byteOffset, inode, sizeof(Inode));
+    return ext2WriteBlock(*fs, blockNum, buf.data()) ? 0 : -1;
 }
 
-// STEP 4: displayInode - Prints out detailed inode metadata in readable format or just layout.
-void displayInode(Inode *inode, uint32_t inodeNum)
+// Evicts least recently used inodes past capacity; dirty ones are stored
+// first. An inode that cannot be stored is kept and the cache is left over
+// capacity rather than lose it. Caller holds icache.lock.
+static void trimInodeCache(Ext2File *fs)
 {
-    std::cout << "Inode " << inodeNum << ":\n";
-    std::cout << "Offset: 0x0\n";
-    std::cout << "00 01 02 03 04 05 06 07 08 09 0a 0b 0c 0d 0e 0f  0...4...8...c...\n";
-    std::cout << "+-----------------------------------------------+ +----------------+\n";
-
-    uint8_t *bytes = reinterpret_cast<uint8_t *>(inode);
-    for (int i = 0; i < 128; i += 16)
+    InodeCache &ic = fs->icache;
+    while (ic.inodes.overFull())
     {
-        std::cout << std::setw(2) << std::setfill('0') << std::hex << i << "|";
-        for (int j = 0; j < 16; j++)
+        auto &victim = ic.inodes.oldest();
+        if (victim.second.dirty)
         {
-            std::cout << std::setw(2) << std::setfill('0')
-                      << static_cast<int>(bytes[i + j]) << " ";
+            if (storeInode(fs, victim.first, &victim.second.inode) != 0)
+            {
+                std::cerr << "trimInodeCache: cannot store inode " << victim.first
+                          << ", keeping it cached\n";
+                return;
+            }
+            victim.second.dirty = false;
+            ic.dirtyCount--;
         }
+        ic.inodes.popOldest();
+    }
+}
 
-        std::cout << "|";
-        std::cout << std::setw(2) << std::setfill('0') << std::hex << i << "|";
+// Writes all dirty inodes back, grouped so that each inode-table block is
+// read and written once no matter how many of its inodes changed. Inodes
+// whose block cannot be read or written stay dirty for the next flush.
+int flushInodeCache(Ext2File *fs)
+{
+    InodeCache &ic = fs->icache;
+    std::lock_guard<std::mutex> lock(ic.lock);
+    if (ic.dirtyCount == 0)
+        return 0;
 
-        for (int j = 0; j < 16; j++)
-        {
-            char c = static_cast<char>(bytes[i + j]);
+    // block -> (offset, inode) pairs, ordered by block
+    std::map<uint32_t, std::vector<std::pair<uint32_t, CachedInode *>>> byBlock;
+    for (auto &entry : ic.inodes.order)
+    {
+        if (!entry.second.dirty)
+            continue;
+        uint32_t blockNum, offset;
+        inodeLocation(fs, entry.first, blockNum, offset);
+        byBlock[blockNum].push_back(std::make_pair(offset, &entry.second));
+    }
+
+    int rc = 0;
+    std::vector<uint8_t> buf(fs->blockSize);
+    for (auto &blk : byBlock)
+    {
+        if (!ext2ReadBlock(*fs, blk.first, buf.data()))
+        {
+            rc = -1;
+            continue;
+        }
+        for (auto &item : blk.second)
+            std::memcpy(buf.data() + item.first, &item.second->inode, sizeof(Inode));
+        if (!ext2WriteBlock(*fs, blk.first, buf.data()))
+        {
+            rc = -1;
+            continue;
+        }
+        // only inodes whose block reached the cache/image are clean now
+        for (auto &item : blk.second)
+        {
+            item.second->dirty = false;
+            ic.dirtyCount--;
+        }
+    }
+    return rc;
+}
+
+// Resizes the inode cache; 0 flushes and disables it.
+void setInodeCacheSize(Ext2File *fs, size_t inodes)
+{
+    if (inodes == 0)
+        flushInodeCache(fs);
+    std::lock_guard<std::mutex> lock(fs->icache.lock);
+    fs->icache.inodes.capacity = inodes;
+    trimInodeCache(fs);
+}
+
+// Replaces `inode` with the cached copy if that copy is dirty. For bulk
+// readers that parse inode tables directly.
+bool inodeCacheOverlay(Ext2File *fs, uint32_t iNum, Inode *inode)
+{
+    InodeCache &ic = fs->icache;
+    if (__atomic_load_n(&ic.dirtyCount, __ATOMIC_RELAXED) == 0)
+        return false;
+    std::lock_guard<std::mutex> lock(ic.lock);
+    CachedInode *ci = ic.inodes.peek(iNum);
+    if (!ci || !ci->dirty)
+        return false;
+    *inode = ci->inode;
+    return true;
+}
+
+// STEP 4: fetchInode - Retrieves a specific inode from disk.
+// Implements inode location logic described in step4.pdf.
+int fetchInode(Ext2File *fs, uint32_t iNum, Inode *inode)
+{
+    if (iNum == 0 || iNum > fs->sb.s_inodes_count)
+        return -1;
+    uint32_t group = (iNum - 1) / fs->sb.s_inodes_per_group;
+    uint32_t index = (iNum - 1) % fs->sb.s_inodes_per_group;
+    uint32_t inodesPerBlock = fs->blockSize / fs->inodeSize;
+    uint32_t blockIndex = index / inodesPerBlock;
+    uint32_t offset = (index % inodesPerBlock) * fs->inodeSize;
+    uint32_t blockNum = fs->bgdt[group].bg_inode_table + blockIndex;
+
+    InodeCache &ic = fs->icache;
+    if (ic.inodes.capacity == 0)
+        return ext2ReadPartial(*fs, blockNum, offset, inode, sizeof(Inode)) ? 0 : -1;
+    {
+        std::lock_guard<std::mutex> lock(ic.lock);
+        if (CachedInode *ci = ic.inodes.find(iNum))
+        {
+            ic.hits++;
+            *inode = ci->inode;
+            return 0;
+        }
+        ic.misses++;
+    }
+    if (!ext2ReadPartial(*fs, blockNum, offset, inode, sizeof(Inode)))
+        return -1;
+
+    std::lock_guard<std::mutex> lock(ic.lock);
+    if (CachedInode *ci = ic.inodes.peek(iNum))
+    {
+        *inode = ci->inode; // written while we were reading
+        return 0;
+    }
+    CachedInode ci;
+    ci.inode = *inode;
+    ic.inodes.insert(iNum, ci);
+    trimInodeCache(fs);
+    return 0;
+}
+
+// File size in bytes. Regular files keep the high 32 bits in i_dir_acl
+// (large_file); for directories that field is the ACL block.
+uint64_t inodeSize(const Inode *inode)
+{
+    uint64_t size = inode->i_size;
+    if ((inode->i_mode & 0xF000) == 0x8000)
+    {
+        size |= (uint64_t)inode->i_dir_acl << 32;
+    }
+    return size;
+}
+
+// STEP 4: displayInode - Prints out detailed inode metadata in readable format or just layout.
+void displayInode(Inode *inode, uint32_t inodeNum)
+{
+    std::cout << "Inode " << inodeNum << ":\n";
+    std::cout << "Offset: 0x0\n";
+    std::cout << "00 01 02 03 04 05 06 07 08 09 0a 0b 0c 0d 0e 0f  0...4...8...c...\n";
+    std::cout << "+-----------------------------------------------+ +----------------+\n";
+
+    uint8_t *bytes = reinterpret_cast<uint8_t *>(inode);
+    for (int i = 0; i < 128; i += 16)
+    {
+        std::cout << std::setw(2) << std::setfill('0') << std::hex << i << "|";
+        for (int j = 0; j < 16; j++)
+        {
+            std::cout << std::setw(2) << std::setfill('0')
+                      << static_cast<int>(bytes[i + j]) << " ";
+        }
+
+        std::cout << "|";
+        std::cout << std::setw(2) << std::setfill('0') << std::hex << i << "|";
+
+        for (int j = 0; j < 16; j++)
+        {
+            char c = static_cast<char>(bytes[i + j]);
             if (std::isprint(static_cast<unsigned char>(c)))
                 std::cout << c;
             else
@@ -689,7 +1971,7 @@ void displayInode(Inode *inode, uint32_t inodeNum)
               << ((inode->i_mode & 0x0001) ? "x" : "-")
               << std::dec << "\n";
 
-    std::cout << "Size: " << inode->i_size << "\n";
+    std::cout << "Size: " << inodeSize(inode) << "\n";
     std::cout << "Blocks: " << inode->i_blocks << "\n";
     std::cout << "UID / GID: " << inode->i_uid << " / " << inode->i_gid << "\n";
     std::cout << "Links: " << inode->i_links_count << "\n";
@@ -729,19 +2011,122 @@ void displayInode(Inode *inode, uint32_t inodeNum)
 // ----------------------------------------------------------------------------
 // STEP 4d: VDI write & MBR write
 // ----------------------------------------------------------------------------
+// Gives virtual block `vblock` a fresh block at the end of the image and
+// records it in the on-disk block map and header. Safe to race with other
+// writers: whoever takes allocLock first allocates, the rest see the entry.
+static bool vdiAllocateBlock(VDIFile &vdi, uint64_t vblock)
+{
+    std::lock_guard<std::mutex> lock(vdi.allocLock);
+    if (vdi.blockMap[vblock] != VDI_BLOCK_FREE && vdi.blockMap[vblock] != VDI_BLOCK_ZERO)
+        return true;
+
+    uint32_t entry = vdi.blocksAllocated;
+    uint64_t physical = vdi.frameOffset + (uint64_t)entry * (vdi.blockSize + vdi.blockExtra);
+
+    std::vector<uint8_t> zeros(vdi.blockSize + vdi.blockExtra, 0);
+    if (pwriteFull(vdi.fd, zeros.data(), zeros.size(), physical) < zeros.size())
+        return false;
+    if (pwriteFull(vdi.fd, &entry, sizeof(entry),
+                   vdi.mapOffset + vblock * sizeof(uint32_t)) < sizeof(entry))
+        return false;
+    uint32_t allocated = entry + 1;
+    if (pwriteFull(vdi.fd, &allocated, sizeof(allocated), 0x184) < sizeof(allocated))
+        return false;
+
+    vdi.blocksAllocated = allocated;
+    __atomic_store_n(&vdi.blockMap[vblock], entry, __ATOMIC_RELEASE);
+    return true;
+}
+
 int64_t vdiWrite(VDIFile &vdi, uint64_t diskOffset, const void *buf, size_t count)
 {
     if (diskOffset >= vdi.diskSize)
         return 0;
+    if (!vdi.writable)
+        return -1;
     uint64_t remain = vdi.diskSize - diskOffset;
     size_t toWrite = (count > remain) ? remain : count;
 
-    uint64_t physical = vdi.frameOffset + diskOffset;
-    vdi.file.seekp((std::streamoff)physical, std::ios::beg);
-    if (!vdi.file.good())
+    const uint8_t *in = reinterpret_cast<const uint8_t *>(buf);
+    size_t done = 0;
+    while (done < toWrite)
+    {
+        size_t run = toWrite - done;
+        int64_t physical = vdiTranslate(vdi, diskOffset + done, run);
+        if (physical < 0)
+        {
+            // first write into a sparse block: allocate it, then retry
+            if (!vdiAllocateBlock(vdi, (diskOffset + done) / vdi.blockSize))
+                return done > 0 ? (int64_t)done : -1;
+            continue;
+        }
+        size_t put = pwriteFull(vdi.fd, in + done, run, (uint64_t)physical);
+        done += put;
+        if (put < run)
+            return done > 0 ? (int64_t)done : -1;
+    }
+    return (int64_t)done;
+}
+
+// Gather counterpart of vdiWrite: writes the buffers in `iov`, in order,
+// to consecutive disk bytes from diskOffset. Each stretch that is
+// contiguous in the image file becomes one pwritev; sparse blocks are
+// allocated on the way. Returns the bytes written, or -1 on error before
+// any were.
+int64_t vdiWritev(VDIFile &vdi, uint64_t diskOffset, const struct iovec *iov, int iovcnt)
+{
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+    if (diskOffset >= vdi.diskSize)
+        return 0;
+    if (!vdi.writable)
         return -1;
-    vdi.file.write(reinterpret_cast<const char *>(buf), toWrite);
-    return vdi.file.good() ? toWrite : -1;
+    if (total > vdi.diskSize - diskOffset)
+        total = (size_t)(vdi.diskSize - diskOffset);
+
+    int idx = 0;     // current caller buffer
+    size_t used = 0; // bytes of iov[idx] already taken
+    size_t done = 0;
+    std::vector<struct iovec> batch;
+    while (done < total)
+    {
+        size_t len = total - done;
+        int64_t physical = vdiTranslate(vdi, diskOffset + done, len);
+        if (physical < 0)
+        {
+            // first write into a sparse block: allocate it, then retry
+            if (!vdiAllocateBlock(vdi, (diskOffset + done) / vdi.blockSize))
+                return done > 0 ? (int64_t)done : -1;
+            continue;
+        }
+        while (done + len < total)
+        {
+            size_t more = total - done - len;
+            if (vdiTranslate(vdi, diskOffset + done + len, more) != physical + (int64_t)len)
+                break;
+            len += more;
+        }
+
+        batch.clear();
+        for (size_t need = len; need > 0;)
+        {
+            size_t take = std::min(need, iov[idx].iov_len - used);
+            batch.push_back({reinterpret_cast<uint8_t *>(iov[idx].iov_base) + used, take});
+            need -= take;
+            used += take;
+            if (used == iov[idx].iov_len)
+            {
+                idx++;
+                used = 0;
+            }
+        }
+        size_t put = pwritevFull(vdi.fd, batch, (uint64_t)physical);
+        done += put;
+        if (put < len)
+            return done > 0 ? (int64_t)done : -1;
+    }
+    return (int64_t)done;
 }
 
 int64_t mbrWrite(MBRPartition &mp, const void *buf, size_t count)
@@ -758,38 +2143,107 @@ int64_t mbrWrite(MBRPartition &mp, const void *buf, size_t count)
     return written;
 }
 
+// Positional write into the partition; unlike mbrWrite it leaves the
+// shared cursor alone, so concurrent writers do not interfere.
+int64_t mbrWriteAt(MBRPartition &mp, uint64_t offset, const void *buf, size_t count)
+{
+    if (offset >= mp.sizeBytes)
+        return 0;
+    uint64_t remain = mp.sizeBytes - offset;
+    size_t toWrite = (count > remain) ? remain : count;
+    return vdiWrite(*mp.vdi, mp.startByte + offset, buf, toWrite);
+}
+
 // ----------------------------------------------------------------------------
 // STEP 4e: writeInode – writes a modified Inode back into the fs
 // ----------------------------------------------------------------------------
 // STEP 4: writeInode - Writes updated inode data back to disk.
+// With the inode cache on, this only updates the cached copy and marks it
+// dirty; flushInodeCache (or ext2Close) writes it out.
 int writeInode(Ext2File *fs, uint32_t iNum, const Inode *inode)
 {
-    // 1) locate group & index just like fetchInode
-    uint32_t group = (iNum - 1) / fs->sb.s_inodes_per_group;
-    uint32_t indexInGroup = (iNum - 1) % fs->sb.s_inodes_per_group;
-    uint32_t inodesPerBlock = fs->blockSize / fs->inodeSize;
-
-    uint32_t blockOffset = indexInGroup / inodesPerBlock;
-    uint32_t byteOffset = (indexInGroup % inodesPerBlock) * fs->inodeSize;
-    uint32_t blockNum = fs->bgdt[group].bg_inode_table + blockOffset;
-
-    // 2) read that block, overwrite the 128‑byte inode, and write it back
-    std::vector<uint8_t> buf(fs->blockSize);
-    if (!ext2ReadBlock(*fs, blockNum, buf.data()))
+    if (iNum == 0 || iNum > fs->sb.s_inodes_count)
         return -1;
-
-    std::memcpy(buf.data() + byteOffset, inode, sizeof(Inode));
-
-    // now write the modified block
-    // seek to blockNum * blockSize within the partition
-    mbrSeek(*fs->part, blockNum * fs->blockSize);
-    int64_t w = mbrWrite(*fs->part, buf.data(), fs->blockSize);
-    return (w == (int64_t)fs->blockSize) ? 0 : -1;
+    InodeCache &ic = fs->icache;
+    if (ic.inodes.capacity == 0)
+        return storeInode(fs, iNum, inode);
+
+    std::lock_guard<std::mutex> lock(ic.lock);
+    CachedInode *ci = ic.inodes.find(iNum);
+    if (!ci)
+        ci = &ic.inodes.insert(iNum, CachedInode());
+    ci->inode = *inode;
+    if (!ci->dirty)
+    {
+        ci->dirty = true;
+        ic.dirtyCount++;
+    }
+    trimInodeCache(fs);
+    return 0;
 }
 
 // ----------------------------------------------------------------------------
 // STEP 4f: inode‑bitmap helpers
 // ----------------------------------------------------------------------------
+// Bitmap search works a 64-bit word at a time: a word of all ones is
+// skipped with one compare, otherwise count-trailing-zeros of the inverted
+// word is the first free bit. With SSE2, fully used 16-byte stretches are
+// skipped first. Bits past `nbits` are treated as in use.
+
+static inline uint64_t loadBitmapWord(const uint8_t *bitmap, uint32_t word, uint32_t nbits)
+{
+    uint32_t firstBit = word * 64;
+    uint32_t bytes = std::min<uint32_t>(8, (nbits - firstBit + 7) / 8);
+    uint64_t w = ~0ULL;
+    std::memcpy(&w, bitmap + word * 8, bytes); // little-endian, as on disk
+    uint32_t valid = nbits - firstBit;
+    if (valid < 64)
+        w |= ~0ULL << valid;
+    return w;
+}
+
+// Index of the first clear bit in [start, nbits), or UINT32_MAX if none.
+uint32_t findFirstZeroBit(const uint8_t *bitmap, uint32_t nbits, uint32_t start = 0)
+{
+    if (start >= nbits)
+        return UINT32_MAX;
+    uint32_t words = (nbits + 63) / 64;
+    uint32_t word = start / 64;
+
+    // first (partial) word: pretend bits before `start` are used
+    uint64_t w = loadBitmapWord(bitmap, word, nbits) | ((1ULL << (start % 64)) - 1);
+    if (w != ~0ULL)
+        return word * 64 + (uint32_t)__builtin_ctzll(~w);
+    word++;
+
+#ifdef __SSE2__
+    const __m128i ones = _mm_set1_epi8((char)0xFF);
+    while ((word + 2) * 64 <= nbits)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bitmap + word * 8));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, ones)) != 0xFFFF)
+            break;
+        word += 2;
+    }
+#endif
+    for (; word < words; word++)
+    {
+        w = loadBitmapWord(bitmap, word, nbits);
+        if (w != ~0ULL)
+            return word * 64 + (uint32_t)__builtin_ctzll(~w);
+    }
+    return UINT32_MAX;
+}
+
+// Number of clear bits among the first `nbits`.
+uint32_t countZeroBits(const uint8_t *bitmap, uint32_t nbits)
+{
+    uint32_t zeros = 0;
+    for (uint32_t word = 0; word < (nbits + 63) / 64; word++)
+        zeros += (uint32_t)__builtin_popcountll(~loadBitmapWord(bitmap, word, nbits));
+    return zeros;
+}
+
 // Returns true if inode iNum is marked in the bitmap
 // STEP 4: inodeInUse - Checks inode bitmap to see if an inode is allocated.
 bool inodeInUse(Ext2File *fs, uint32_t iNum)
@@ -806,46 +2260,186 @@ bool inodeInUse(Ext2File *fs, uint32_t iNum)
     return (bitmap[byte] & (1 << bit)) != 0;
 }
 
+// Records that group g's descriptor and the superblock changed; they are
+// written by the next ext2SyncMetadata, not now.
+static void markGroupDirty(Ext2File *fs, uint32_t g)
+{
+    fs->sbDirty = true;
+    size_t b = g * sizeof(Ext2BlockGroupDescriptor) / fs->blockSize;
+    if (b < fs->bgdtDirty.size())
+        fs->bgdtDirty[b] = true;
+}
+
+// Adjust the free/used counters of group g and the matching superblock
+// totals (bg_used_dirs_count has no superblock total).
+static void adjustFreeInodes(Ext2File *fs, uint32_t g, int delta, int dirDelta = 0)
+{
+    fs->bgdt[g].bg_free_inodes_count += delta;
+    fs->bgdt[g].bg_used_dirs_count += dirDelta;
+    fs->sb.s_free_inodes_count += delta;
+    markGroupDirty(fs, g);
+}
+
+static void adjustFreeBlocks(Ext2File *fs, uint32_t g, int delta)
+{
+    fs->bgdt[g].bg_free_blocks_count += delta;
+    fs->sb.s_free_blocks_count += delta;
+    markGroupDirty(fs, g);
+}
+
+// Takes the first free inode of group g, or returns 0. The in-memory
+// free counts (descriptor and superblock) follow the bitmap.
+static uint32_t allocateInodeInGroup(Ext2File *fs, uint32_t g)
+{
+    if (fs->bgdt[g].bg_free_inodes_count == 0)
+        return 0;
+    std::vector<uint8_t> bitmap(fs->blockSize);
+    ext2ReadBlock(*fs, fs->bgdt[g].bg_inode_bitmap, bitmap.data());
+    uint32_t i = findFirstZeroBit(bitmap.data(), fs->sb.s_inodes_per_group);
+    if (i == UINT32_MAX)
+        return 0;
+    // mark and write back
+    bitmap[i / 8] |= (1 << (i % 8));
+    ext2WriteBlock(*fs, fs->bgdt[g].bg_inode_bitmap, bitmap.data());
+    adjustFreeInodes(fs, g, -1);
+    return g * fs->sb.s_inodes_per_group + i + 1;
+}
+
 // Finds & marks a free inode
 // STEP 4: allocateInode - Finds and allocates a free inode in the bitmap.
+// Groups whose descriptor says they have no free inodes are skipped
+// without reading their bitmap. The search starts at groupHint and wraps.
 uint32_t allocateInode(Ext2File *fs, int32_t groupHint = -1)
 {
     uint32_t groups = fs->numBlockGroups;
-    for (uint32_t g = (groupHint < 0 ? 0 : groupHint); g < groups; ++g)
+    uint32_t start = (groupHint < 0 || (uint32_t)groupHint >= groups) ? 0 : groupHint;
+    for (uint32_t n = 0; n < groups; ++n)
+    {
+        if (uint32_t iNum = allocateInodeInGroup(fs, (start + n) % groups))
+            return iNum;
+    }
+    return 0; // none free
+}
+
+// Picks the group for a new inode the way ext2's Orlov allocator does:
+//  - directories directly under the root go to the group with the fewest
+//    directories among those with at least average free inodes and blocks,
+//    so top-level trees spread over the disk;
+//  - deeper directories stay near their parent unless that group is
+//    already crowded with directories or short of space;
+//  - files go to the parent directory's group, then to groups at
+//    power-of-two distances from it, then to any group.
+// Returns -1 to mean "no preference" (first fit from the parent's group).
+static int32_t chooseInodeGroup(Ext2File *fs, uint32_t parentINum, bool isDir)
+{
+    uint32_t groups = fs->numBlockGroups;
+    uint32_t ipg = fs->sb.s_inodes_per_group;
+    uint32_t parentGroup = (parentINum - 1) / ipg % groups;
+    auto hasRoom = [fs](uint32_t g) {
+        return fs->bgdt[g].bg_free_inodes_count > 0 && fs->bgdt[g].bg_free_blocks_count > 0;
+    };
+
+    if (!isDir)
     {
-        std::vector<uint8_t> bitmap(fs->blockSize);
-        ext2ReadBlock(*fs, fs->bgdt[g].bg_inode_bitmap, bitmap.data());
-        for (uint32_t i = 0; i < fs->sb.s_inodes_per_group; ++i)
+        if (hasRoom(parentGroup))
+            return parentGroup;
+        uint32_t g = parentGroup;
+        for (uint32_t step = 1; step < groups; step <<= 1)
         {
-            uint32_t b = i / 8, bit = i % 8;
-            if (!(bitmap[b] & (1 << bit)))
-            {
-                // mark and write back
-                bitmap[b] |= (1 << bit);
-                mbrSeek(*fs->part, fs->bgdt[g].bg_inode_bitmap * fs->blockSize + b);
-                mbrWrite(*fs->part, &bitmap[b], 1);
-                return g * fs->sb.s_inodes_per_group + i + 1;
-            }
+            g = (g + step) % groups;
+            if (hasRoom(g))
+                return g;
         }
+        return -1;
     }
-    return 0; // none free
+
+    uint64_t freeInodes = 0, freeBlocks = 0, dirs = 0;
+    for (uint32_t g = 0; g < groups; g++)
+    {
+        freeInodes += fs->bgdt[g].bg_free_inodes_count;
+        freeBlocks += fs->bgdt[g].bg_free_blocks_count;
+        dirs += fs->bgdt[g].bg_used_dirs_count;
+    }
+    uint64_t aveFreeInodes = freeInodes / groups;
+    uint64_t aveFreeBlocks = freeBlocks / groups;
+
+    if (parentINum == 2)
+    {
+        int32_t best = -1;
+        uint32_t bestDirs = UINT32_MAX;
+        uint32_t start = (uint32_t)(dirs * 0x9E3779B1u) % groups; // rotate ties
+        for (uint32_t n = 0; n < groups; n++)
+        {
+            uint32_t g = (start + n) % groups;
+            const Ext2BlockGroupDescriptor &bg = fs->bgdt[g];
+            if (bg.bg_used_dirs_count >= bestDirs || bg.bg_free_inodes_count < aveFreeInodes ||
+                bg.bg_free_blocks_count < aveFreeBlocks)
+                continue;
+            best = g;
+            bestDirs = bg.bg_used_dirs_count;
+        }
+        return best;
+    }
+
+    uint64_t maxDirs = dirs / groups + ipg / 16;
+    uint64_t minInodes = aveFreeInodes > ipg / 4 ? aveFreeInodes - ipg / 4 : 1;
+    uint64_t bpg = fs->sb.s_blocks_per_group;
+    uint64_t minBlocks = aveFreeBlocks > bpg / 4 ? aveFreeBlocks - bpg / 4 : 1;
+    for (uint32_t n = 0; n < groups; n++)
+    {
+        uint32_t g = (parentGroup + n) % groups;
+        const Ext2BlockGroupDescriptor &bg = fs->bgdt[g];
+        if (bg.bg_used_dirs_count < maxDirs && bg.bg_free_inodes_count >= minInodes &&
+            bg.bg_free_blocks_count >= minBlocks)
+            return g;
+    }
+    return -1;
+}
+
+// Allocates an inode for a new file or directory created in directory
+// parentINum, placed by chooseInodeGroup (or first fit from group 0 when
+// fs->localPlacement is off). Directories are counted in
+// bg_used_dirs_count. Returns 0 if no inode is free.
+uint32_t allocateInodeFor(Ext2File *fs, uint32_t parentINum, bool isDir)
+{
+    uint32_t iNum = 0;
+    if (!fs->localPlacement)
+    {
+        iNum = allocateInode(fs, 0);
+    }
+    else
+    {
+        int32_t g = chooseInodeGroup(fs, parentINum, isDir);
+        if (g >= 0)
+            iNum = allocateInodeInGroup(fs, g);
+        if (iNum == 0)
+            iNum = allocateInode(fs, (int32_t)((parentINum - 1) / fs->sb.s_inodes_per_group));
+    }
+    if (iNum != 0 && isDir)
+        adjustFreeInodes(fs, (iNum - 1) / fs->sb.s_inodes_per_group, 0, 1);
+    return iNum;
 }
 
+void releaseReservation(Ext2File *fs, uint32_t iNum);
+
 // Frees that inode in the bitmap
 // STEP 4: freeInode - Clears an inode's allocation in the inode bitmap.
-bool freeInode(Ext2File *fs, uint32_t iNum)
+// Pass isDir for directories so bg_used_dirs_count stays right.
+bool freeInode(Ext2File *fs, uint32_t iNum, bool isDir = false)
 {
     uint32_t idx = iNum - 1;
     uint32_t grp = idx / fs->sb.s_inodes_per_group;
     uint32_t bitIdx = idx % fs->sb.s_inodes_per_group;
     uint32_t byte = bitIdx / 8;
     uint32_t bit = bitIdx % 8;
+    releaseReservation(fs, iNum);
 
     std::vector<uint8_t> bitmap(fs->blockSize);
     ext2ReadBlock(*fs, fs->bgdt[grp].bg_inode_bitmap, bitmap.data());
+    if (bitmap[byte] & (1 << bit))
+        adjustFreeInodes(fs, grp, 1, (isDir && fs->bgdt[grp].bg_used_dirs_count > 0) ? -1 : 0);
     bitmap[byte] &= ~(1 << bit);
-    mbrSeek(*fs->part, fs->bgdt[grp].bg_inode_bitmap * fs->blockSize + byte);
-    return mbrWrite(*fs->part, &bitmap[byte], 1) == 1;
+    return ext2WriteBlock(*fs, fs->bgdt[grp].bg_inode_bitmap, bitmap.data());
 }
 
 
@@ -856,8 +2450,8 @@ bool freeInode(Ext2File *fs, uint32_t iNum)
 // --------------------------- STEP 5 ADDITIONS ---------------------------
 //
 // The following functions implement block-level access to file data
-// for EXT2 filesystems. This includes support for direct, single indirect,
-// and double indirect blocks. These functions are required per step5.pdf.
+// for EXT2 filesystems. This includes support for direct, single, double
+// and triple indirect blocks. These functions are required per step5.pdf.
 //
 //  Function: fetchBlockFromFile()
 //     - Reads logical block `bNum` from the file, storing the data in `buf`.
@@ -867,97 +2461,786 @@ bool freeInode(Ext2File *fs, uint32_t iNum)
 //     - May allocate new blocks if necessary.
 // ------------------------------------------------------------------------
 
-int fetchBlockFromFile(Ext2File* fs, Inode* inode, uint32_t bNum, void* buf) {
+// Reads entry `idx` of indirect block `blockNum`, through the mapping
+// when there is one.
+static uint32_t readIndirectEntry(Ext2File* fs, uint32_t blockNum, uint32_t idx) {
+    uint32_t entry = 0;
+    if (!ext2ReadPartial(*fs, blockNum, idx * sizeof(uint32_t), &entry, sizeof(entry))) return 0;
+    return entry;
+}
+
+// Decodes an indirect block into runs of contiguous pointers.
+static void decodeIndirect(Ext2File* fs, uint32_t blockNum, std::vector<BlockRun>& runs) {
+    uint32_t k = fs->blockSize / sizeof(uint32_t);
+    const uint8_t* p = ext2BlockPtr(*fs, blockNum);
+    thread_local std::vector<uint8_t> scratch;
+    if (!p) {
+        scratch.resize(fs->blockSize);
+        ext2ReadBlock(*fs, blockNum, scratch.data());
+        p = scratch.data();
+    }
+    runs.clear();
+    for (uint32_t i = 0; i < k; i++) {
+        uint32_t e;
+        std::memcpy(&e, p + i * sizeof(uint32_t), sizeof(e));
+        if (!runs.empty()) {
+            BlockRun& last = runs.back();
+            bool holes = (last.physical == 0 && e == 0);
+            bool next = (last.physical != 0 && e == last.physical + last.len);
+            if (holes || next) {
+                last.len++;
+                continue;
+            }
+        }
+        runs.push_back({i, e, 1});
+    }
+}
+
+static uint32_t findRun(const std::vector<BlockRun>& runs, uint32_t idx, uint32_t& runLen) {
+    auto it = std::upper_bound(runs.begin(), runs.end(), idx,
+                               [](uint32_t v, const BlockRun& r) { return v < r.index; });
+    const BlockRun& r = *(it - 1);
+    runLen = r.index + r.len - idx;
+    return r.physical ? r.physical + (idx - r.index) : 0;
+}
+
+// Entry `idx` of indirect block `blockNum`, served from the decoded-run
+// cache. runLen is set to how many entries from idx on continue the same
+// run (contiguous blocks, or holes).
+static uint32_t lookupIndirect(Ext2File* fs, uint32_t blockNum, uint32_t idx, uint32_t& runLen) {
+    IndirectMapCache& mc = fs->imap;
+    if (mc.maps.capacity == 0) {
+        runLen = 1;
+        return readIndirectEntry(fs, blockNum, idx);
+    }
+    {
+        std::lock_guard<std::mutex> lock(mc.lock);
+        if (std::vector<BlockRun>* runs = mc.maps.find(blockNum)) {
+            mc.hits++;
+            return findRun(*runs, idx, runLen);
+        }
+        mc.misses++;
+    }
+    std::vector<BlockRun> runs;
+    decodeIndirect(fs, blockNum, runs);
+    uint32_t physical = findRun(runs, idx, runLen);
+
+    std::lock_guard<std::mutex> lock(mc.lock);
+    if (!mc.maps.peek(blockNum)) {
+        mc.maps.insert(blockNum, std::move(runs));
+        while (mc.maps.overFull()) mc.maps.popOldest();
+    }
+    return physical;
+}
+
+// Maps logical block `bNum` of a file to its physical block and reports
+// in runLen how many logical blocks from bNum on are physically contiguous
+// (or, for a hole, how many more are holes). Runs never cross an indirect
+// block, so runLen is a lower bound. Returns 0 for holes.
+uint32_t resolveFileExtent(Ext2File* fs, const Inode* inode, uint32_t bNum, uint32_t& runLen) {
     uint32_t k = fs->blockSize / sizeof(uint32_t);
 
     if (bNum < 12) {
         // Direct block
-        if (inode->i_block[bNum] == 0) return -1;
-        return ext2ReadBlock(*fs, inode->i_block[bNum], buf) ? 0 : -1;
+        uint32_t first = inode->i_block[bNum];
+        runLen = 1;
+        while (bNum + runLen < 12 &&
+               inode->i_block[bNum + runLen] == (first ? first + runLen : 0))
+            runLen++;
+        return first;
     }
 
     bNum -= 12;
     if (bNum < k) {
         // Single indirect block
-        if (inode->i_block[12] == 0) return -1;
-
-        std::vector<uint32_t> sib(k);
-        ext2ReadBlock(*fs, inode->i_block[12], sib.data());
-        if (sib[bNum] == 0) return -1;
-
-        return ext2ReadBlock(*fs, sib[bNum], buf) ? 0 : -1;
+        if (inode->i_block[12] == 0) {
+            runLen = k - bNum;
+            return 0;
+        }
+        return lookupIndirect(fs, inode->i_block[12], bNum, runLen);
     }
 
     bNum -= k;
-    if (bNum < k * k) {
+    if ((uint64_t)bNum < (uint64_t)k * k) {
         // Double indirect block
-        if (inode->i_block[13] == 0) return -1;
+        uint32_t sibRun;
+        uint32_t sib = inode->i_block[13] == 0 ? 0
+                     : lookupIndirect(fs, inode->i_block[13], bNum / k, sibRun);
+        if (sib == 0) {
+            runLen = k - bNum % k;
+            return 0;
+        }
+        return lookupIndirect(fs, sib, bNum % k, runLen);
+    }
 
-        std::vector<uint32_t> dib(k);
-        ext2ReadBlock(*fs, inode->i_block[13], dib.data());
+    bNum -= k * k;
+    if ((uint64_t)bNum < (uint64_t)k * k * k) {
+        // Triple indirect block
+        uint32_t r;
+        uint32_t dib = inode->i_block[14] == 0 ? 0
+                     : lookupIndirect(fs, inode->i_block[14], bNum / (k * k), r);
+        uint32_t sib = dib == 0 ? 0 : lookupIndirect(fs, dib, (bNum / k) % k, r);
+        if (sib == 0) {
+            runLen = k - bNum % k;
+            return 0;
+        }
+        return lookupIndirect(fs, sib, bNum % k, runLen);
+    }
 
-        uint32_t first = bNum / k;
-        uint32_t second = bNum % k;
+    runLen = 1;
+    return 0;
+}
 
-        if (dib[first] == 0) return -1;
+// Maps logical block `bNum` of a file to its physical block number.
+// Returns 0 for holes and for blocks past the supported range.
+uint32_t resolveFileBlock(Ext2File* fs, const Inode* inode, uint32_t bNum) {
+    uint32_t runLen;
+    return resolveFileExtent(fs, inode, bNum, runLen);
+}
 
-        std::vector<uint32_t> sib(k);
-        ext2ReadBlock(*fs, dib[first], sib.data());
+int fetchBlockFromFile(Ext2File* fs, Inode* inode, uint32_t bNum, void* buf) {
+    uint32_t block = resolveFileBlock(fs, inode, bNum);
+    if (block == 0) return -1;
+    return ext2ReadBlock(*fs, block, buf) ? 0 : -1;
+}
 
-        if (sib[second] == 0) return -1;
+// Zero-copy counterpart of fetchBlockFromFile for mapped images.
+const uint8_t* fetchBlockPtrFromFile(Ext2File* fs, const Inode* inode, uint32_t bNum) {
+    uint32_t block = resolveFileBlock(fs, inode, bNum);
+    if (block == 0) return nullptr;
+    return ext2BlockPtr(*fs, block);
+}
 
-        return ext2ReadBlock(*fs, sib[second], buf) ? 0 : -1;
+// Reads logical blocks [first, last) of a file into bufs[0 .. last-first).
+// Block pointers are resolved up front, physically adjacent blocks are
+// grouped into runs, and each run is fetched with a single (scatter) read.
+// Holes come back zero-filled. Returns 0, or -1 if any run failed.
+int readFileBlocksv(Ext2File* fs, const Inode* inode, uint32_t first, uint32_t last, uint8_t* const* bufs) {
+    int rc = 0;
+    for (uint32_t b = first; b < last;) {
+        uint32_t runLen;
+        uint32_t physical = resolveFileExtent(fs, inode, b, runLen);
+        runLen = std::min(runLen, last - b);
+        // extend across indirect-block boundaries while still adjacent
+        while (b + runLen < last) {
+            uint32_t nextLen;
+            uint32_t next = resolveFileExtent(fs, inode, b + runLen, nextLen);
+            if (physical ? next != physical + runLen : next != 0) break;
+            runLen += std::min(nextLen, last - b - runLen);
+        }
+        uint8_t* const* dst = bufs + (b - first);
+        if (physical == 0) {
+            for (uint32_t i = 0; i < runLen; i++) std::memset(dst[i], 0, fs->blockSize);
+        } else if (!ext2ReadBlocksv(*fs, physical, runLen, dst)) {
+            rc = -1;
+        }
+        b += runLen;
     }
+    return rc;
+}
 
-    std::cerr << "Triple indirect not supported in fetchBlockFromFile()\n";
-return -1;
-
+// Contiguous-buffer form: block first+i lands at buf + i*blockSize.
+int readFileBlocks(Ext2File* fs, const Inode* inode, uint32_t first, uint32_t last, void* buf) {
+    std::vector<uint8_t*> bufs(last > first ? last - first : 0);
+    for (size_t i = 0; i < bufs.size(); i++)
+        bufs[i] = reinterpret_cast<uint8_t*>(buf) + i * fs->blockSize;
+    return readFileBlocksv(fs, inode, first, last, bufs.data());
 }
 
-int writeBlockToFile(Ext2File* fs, uint32_t iNum, Inode* inode, uint32_t bNum, const void* buf) {
-    uint32_t k = fs->blockSize / sizeof(uint32_t);
+// Sequential reader for whole files of any size. Block pointers are
+// resolved up to FILE_READ_AHEAD_BLOCKS ahead of the read position; each
+// newly resolved extent is handed to the kernel as read-ahead, so the
+// data is on its way while earlier extents are still being copied out.
+// Reads of whole, aligned blocks go straight into the caller's buffer.
+const uint32_t FILE_READ_AHEAD_BLOCKS = 1024;
 
-    auto allocateDataBlock = [&](void) -> uint32_t {
-        for (uint32_t group = 0; group < fs->numBlockGroups; group++) {
-            uint32_t bitmapBlock = fs->bgdt[group].bg_block_bitmap;
-            std::vector<uint8_t> bitmap(fs->blockSize);
-            if (!ext2ReadBlock(*fs, bitmapBlock, bitmap.data())) continue;
-
-            for (uint32_t i = 0; i < fs->blockSize * 8; ++i) {
-                uint32_t byteIndex = i / 8;
-                uint8_t bitMask = 1 << (i % 8);
-                if ((bitmap[byteIndex] & bitMask) == 0) {
-                    bitmap[byteIndex] |= bitMask;
-                    mbrSeek(*fs->part, bitmapBlock * fs->blockSize);
-                    mbrWrite(*fs->part, bitmap.data(), fs->blockSize);
-                    return group * fs->sb.s_blocks_per_group + i;
-                }
+struct FileExtent
+{
+    uint32_t logical;
+    uint32_t physical; // 0 for a hole
+    uint32_t len;
+};
+
+struct FileReader
+{
+    Ext2File* fs;
+    Inode inode;
+    uint64_t size;
+    uint64_t pos;
+    uint32_t blockCount;
+    uint32_t nextResolve;         // first logical block not yet in `ahead`
+    std::deque<FileExtent> ahead; // resolved extents, in file order
+    std::vector<uint8_t> staging; // one block, for partial-block reads
+};
+
+FileReader* openFileReader(Ext2File* fs, uint32_t iNum) {
+    FileReader* r = new FileReader();
+    if (fetchInode(fs, iNum, &r->inode) != 0) {
+        delete r;
+        return nullptr;
+    }
+    r->fs = fs;
+    r->size = inodeSize(&r->inode);
+    r->pos = 0;
+    r->blockCount = (uint32_t)((r->size + fs->blockSize - 1) / fs->blockSize);
+    r->nextResolve = 0;
+    r->staging.resize(fs->blockSize);
+    return r;
+}
+
+// Resolves extents until `upTo` (or the end of the file) is covered.
+static void resolveAhead(FileReader* r, uint32_t upTo) {
+    upTo = std::min(upTo, r->blockCount);
+    while (r->nextResolve < upTo) {
+        uint32_t len;
+        uint32_t physical = resolveFileExtent(r->fs, &r->inode, r->nextResolve, len);
+        len = std::max(1u, std::min(len, r->blockCount - r->nextResolve));
+        if (!r->ahead.empty()) {
+            FileExtent& last = r->ahead.back();
+            if (last.physical == 0 ? physical == 0 : physical == last.physical + last.len) {
+                last.len += len;
+                r->nextResolve += len;
+                if (physical) ext2WillNeed(*r->fs, physical, len);
+                continue;
             }
         }
-        return 0;
-    };
+        r->ahead.push_back({r->nextResolve, physical, len});
+        r->nextResolve += len;
+        if (physical) ext2WillNeed(*r->fs, physical, len);
+    }
+}
 
-    auto updateInodeSize = [&]() {
-        uint32_t requiredSize = (bNum + 1) * fs->blockSize;
-        if (inode->i_size < requiredSize) {
-            inode->i_size = requiredSize;
-            inode->i_blocks = (requiredSize + 511) / 512;
+// Copies up to `len` bytes from the current position into `buf`. Returns
+// the number of bytes copied (0 at end of file), or -1 on a read error.
+int64_t readFileStream(FileReader* r, void* buf, size_t len) {
+    uint32_t bs = r->fs->blockSize;
+    uint8_t* out = reinterpret_cast<uint8_t*>(buf);
+    uint64_t want = std::min<uint64_t>(len, r->size - r->pos);
+    uint64_t done = 0;
+    while (done < want) {
+        uint32_t block = (uint32_t)(r->pos / bs);
+        uint32_t inner = (uint32_t)(r->pos % bs);
+        resolveAhead(r, block + FILE_READ_AHEAD_BLOCKS);
+        while (r->ahead.front().logical + r->ahead.front().len <= block) r->ahead.pop_front();
+        const FileExtent& e = r->ahead.front();
+        uint32_t skip = block - e.logical;
+        uint64_t left = want - done;
+
+        if (inner == 0 && left >= bs) {
+            // whole blocks, straight into the caller's buffer
+            uint32_t n = (uint32_t)std::min<uint64_t>(e.len - skip, left / bs);
+            if (e.physical == 0) {
+                std::memset(out + done, 0, (size_t)n * bs);
+            } else if (!ext2ReadBlocks(*r->fs, e.physical + skip, n, out + done)) {
+                return done > 0 ? (int64_t)done : -1;
+            }
+            done += (uint64_t)n * bs;
+            r->pos += (uint64_t)n * bs;
+            continue;
         }
-    };
 
-    if (bNum < 12) {
-        if (inode->i_block[bNum] == 0) {
-            inode->i_block[bNum] = allocateDataBlock();
-            updateInodeSize();
+        // head or tail of a block
+        uint32_t n = (uint32_t)std::min<uint64_t>(bs - inner, left);
+        if (e.physical == 0) {
+            std::memset(out + done, 0, n);
+        } else {
+            if (!ext2ReadBlocks(*r->fs, e.physical + skip, 1, r->staging.data()))
+                return done > 0 ? (int64_t)done : -1;
+            std::memcpy(out + done, r->staging.data() + inner, n);
         }
-        mbrSeek(*fs->part, inode->i_block[bNum] * fs->blockSize);
-        return mbrWrite(*fs->part, buf, fs->blockSize) == (int64_t)fs->blockSize ? 0 : -1;
+        done += n;
+        r->pos += n;
     }
-
-    // Further indirect levels can be added as needed (single/double indirect)
-    std::cerr << "Only direct blocks are supported in writeBlockToFile() for now\n";
-return -1;
-
+    return (int64_t)done;
+}
+
+void closeFileReader(FileReader* r) {
+    delete r;
+}
+
+// Fills `out` with the physical block of logical blocks [0, count) of a
+// file (0 for holes), reading each indirect block exactly once.
+void listFileBlocks(Ext2File* fs, const Inode* inode, uint32_t count, std::vector<uint32_t>& out) {
+    uint32_t k = fs->blockSize / sizeof(uint32_t);
+    out.assign(count, 0);
+    uint32_t pos = 0;
+    for (; pos < 12 && pos < count; pos++) out[pos] = inode->i_block[pos];
+
+    // walks an indirect block of the given level, filling from out[pos];
+    // each level has its own buffer so recursion does not clobber it
+    std::vector<std::vector<uint32_t>> levels(3, std::vector<uint32_t>(k));
+    std::function<void(uint32_t, int)> walk = [&](uint32_t block, int level) {
+        uint64_t span = 1;
+        for (int i = 1; i < level; i++) span *= k;
+        if (block == 0) {
+            pos = (uint32_t)std::min<uint64_t>(count, pos + span * k);
+            return;
+        }
+        std::vector<uint32_t>& ib = levels[level - 1];
+        ext2ReadBlock(*fs, block, ib.data());
+        for (uint32_t i = 0; i < k && pos < count; i++) {
+            if (level == 1) out[pos++] = ib[i];
+            else walk(ib[i], level - 1);
+        }
+    };
+    for (int level = 1; level <= 3 && pos < count; level++) walk(inode->i_block[11 + level], level);
+}
+
+// Number of blocks covered by group g's block bitmap (the last group is
+// usually shorter than s_blocks_per_group).
+static uint32_t blocksInGroup(Ext2File* fs, uint32_t g) {
+    uint32_t first = fs->sb.s_first_data_block + g * fs->sb.s_blocks_per_group;
+    return std::min(fs->sb.s_blocks_per_group, fs->sb.s_blocks_count - first);
+}
+
+// ---- free-extent index ----
+
+// Adds the free run [start, start+len) to g, merging it with the extents
+// on either side.
+static void extentAdd(GroupExtents& g, uint32_t start, uint32_t len) {
+    auto next = g.byStart.lower_bound(start);
+    if (next != g.byStart.begin()) {
+        auto prev = std::prev(next);
+        if (prev->first + prev->second == start) {
+            start = prev->first;
+            len += prev->second;
+            g.byLen.erase({prev->second, prev->first});
+            g.byStart.erase(prev);
+        }
+    }
+    if (next != g.byStart.end() && start + len == next->first) {
+        len += next->second;
+        g.byLen.erase({next->second, next->first});
+        g.byStart.erase(next);
+    }
+    g.byStart[start] = len;
+    g.byLen.insert({len, start});
+}
+
+// Removes [start, start+len), which must lie inside one extent of g,
+// keeping whatever is left on either side.
+static void extentRemove(GroupExtents& g, uint32_t start, uint32_t len) {
+    auto it = std::prev(g.byStart.upper_bound(start));
+    uint32_t eStart = it->first, eLen = it->second;
+    g.byLen.erase({eLen, eStart});
+    g.byStart.erase(it);
+    if (start > eStart) {
+        g.byStart[eStart] = start - eStart;
+        g.byLen.insert({start - eStart, eStart});
+    }
+    uint32_t end = start + len, eEnd = eStart + eLen;
+    if (end < eEnd) {
+        g.byStart[end] = eEnd - end;
+        g.byLen.insert({eEnd - end, end});
+    }
+}
+
+// Rebuilds fs->freeIndex from the block bitmaps (one read per group).
+// Returns false, leaving the index unbuilt, if a bitmap cannot be read.
+bool buildFreeExtentIndex(Ext2File* fs) {
+    FreeExtentIndex& fx = fs->freeIndex;
+    fx.built = false;
+    fx.groups.assign(fs->numBlockGroups, GroupExtents());
+    std::vector<uint8_t> bitmap(fs->blockSize);
+    for (uint32_t g = 0; g < fs->numBlockGroups; g++) {
+        if (!ext2ReadBlock(*fs, fs->bgdt[g].bg_block_bitmap, bitmap.data())) {
+            fx.groups.clear();
+            return false;
+        }
+        uint32_t base = fs->sb.s_first_data_block + g * fs->sb.s_blocks_per_group;
+        uint32_t n = blocksInGroup(fs, g);
+        for (uint32_t i = findFirstZeroBit(bitmap.data(), n); i != UINT32_MAX;) {
+            uint32_t end = i + 1;
+            while (end < n && !(bitmap[end / 8] & (1 << (end % 8)))) end++;
+            extentAdd(fx.groups[g], base + i, end - i);
+            i = end < n ? findFirstZeroBit(bitmap.data(), n, end) : UINT32_MAX;
+        }
+    }
+    fx.built = true;
+    return true;
+}
+
+// Sets (used) or clears the bitmap bits of `blocks`, one bitmap
+// read/write per group (the write only if a bit changed), and adjusts the
+// free counts for every bit that actually changed. Fills `changed` with
+// those blocks and, if given, `unread` with the blocks of groups whose
+// bitmap could not be read, both in ascending order.
+static void setBlockBits(Ext2File* fs, const std::vector<uint32_t>& blocks, bool used,
+                         std::vector<uint32_t>& changed, std::vector<uint32_t>* unread = nullptr) {
+    uint32_t bpg = fs->sb.s_blocks_per_group;
+    uint32_t first = fs->sb.s_first_data_block;
+    std::map<uint32_t, std::vector<uint32_t>> byGroup;
+    for (uint32_t blk : blocks) {
+        uint32_t rel = blk - first;
+        byGroup[rel / bpg].push_back(rel % bpg);
+    }
+    changed.clear();
+    if (unread) unread->clear();
+    std::vector<uint8_t> bitmap(fs->blockSize);
+    for (auto& g : byGroup) {
+        uint32_t bitmapBlock = fs->bgdt[g.first].bg_block_bitmap;
+        std::sort(g.second.begin(), g.second.end());
+        if (!ext2ReadBlock(*fs, bitmapBlock, bitmap.data())) {
+            if (unread)
+                for (uint32_t i : g.second) unread->push_back(first + g.first * bpg + i);
+            continue;
+        }
+        bool dirty = false;
+        for (uint32_t i : g.second) {
+            bool set = bitmap[i / 8] & (1 << (i % 8));
+            if (set == used) continue;
+            bitmap[i / 8] ^= (1 << (i % 8));
+            adjustFreeBlocks(fs, g.first, used ? -1 : 1);
+            changed.push_back(first + g.first * bpg + i);
+            dirty = true;
+        }
+        if (dirty) ext2WriteBlock(*fs, bitmapBlock, bitmap.data());
+    }
+}
+
+// Returns an ascending list of free blocks to the free-extent index,
+// one extentAdd per run of consecutive blocks.
+static void indexAddBlocks(Ext2File* fs, const std::vector<uint32_t>& blocks) {
+    uint32_t bpg = fs->sb.s_blocks_per_group;
+    for (size_t i = 0; i < blocks.size();) {
+        size_t j = i + 1;
+        uint32_t g = (blocks[i] - fs->sb.s_first_data_block) / bpg;
+        while (j < blocks.size() && blocks[j] == blocks[j - 1] + 1 &&
+               (blocks[j] - fs->sb.s_first_data_block) / bpg == g)
+            j++;
+        extentAdd(fs->freeIndex.groups[g], blocks[i], (uint32_t)(j - i));
+        i = j;
+    }
+}
+
+// allocateBlocks through the free-extent index. In order of preference:
+// the free run starting at `goal` (so appends stay contiguous), the
+// smallest extent that holds everything still needed, searching groups
+// forward from the goal's, and finally, when free space is too broken up
+// for that, the largest extents available.
+static uint32_t allocateExtents(Ext2File* fs, uint32_t count, uint32_t goal, std::vector<uint32_t>& out) {
+    FreeExtentIndex& fx = fs->freeIndex;
+    uint32_t groups = fs->numBlockGroups;
+    uint32_t goalGroup = (goal - fs->sb.s_first_data_block) / fs->sb.s_blocks_per_group;
+    std::vector<uint32_t> picked;
+    auto take = [&](uint32_t g, uint32_t start, uint32_t len) {
+        extentRemove(fx.groups[g], start, len);
+        for (uint32_t i = 0; i < len; i++) picked.push_back(start + i);
+    };
+
+    GroupExtents& gg = fx.groups[goalGroup];
+    auto at = gg.byStart.upper_bound(goal);
+    if (at != gg.byStart.begin()) {
+        --at;
+        if (goal < at->first + at->second)
+            take(goalGroup, goal, std::min(count, at->first + at->second - goal));
+    }
+    for (uint32_t n = 0; n < groups && picked.size() < count; n++) {
+        uint32_t g = (goalGroup + n) % groups;
+        uint32_t need = count - (uint32_t)picked.size();
+        auto fit = fx.groups[g].byLen.lower_bound({need, 0});
+        if (fit != fx.groups[g].byLen.end()) take(g, fit->second, need);
+    }
+    for (uint32_t n = 0; n < groups && picked.size() < count; n++) {
+        uint32_t g = (goalGroup + n) % groups;
+        while (picked.size() < count && !fx.groups[g].byLen.empty()) {
+            auto big = std::prev(fx.groups[g].byLen.end());
+            take(g, big->second, std::min(big->first, count - (uint32_t)picked.size()));
+        }
+    }
+
+    std::vector<uint32_t> changed, unread;
+    setBlockBits(fs, picked, true, changed, &unread);
+    // blocks whose bitmap could not be read are still free: back they go
+    indexAddBlocks(fs, unread);
+    if (changed.size() + unread.size() != picked.size())
+        std::cerr << "allocateBlocks: free-extent index disagrees with the block bitmaps\n";
+    // keep the allocation order (runs as picked), minus any block that
+    // could not be marked or turned out to be in use already
+    for (uint32_t blk : picked)
+        if (std::binary_search(changed.begin(), changed.end(), blk)) out.push_back(blk);
+    return (uint32_t)changed.size();
+}
+
+// Reserves up to `count` free blocks, searching forward from block `goal`
+// and wrapping around the disk. Each group touched costs one bitmap read
+// and one bitmap write, however many blocks it supplies; full groups (by
+// their descriptor) are skipped unread. Blocks are appended to `out` in
+// ascending order within a group, so a batch is as contiguous as free
+// space allows. Returns how many blocks were reserved.
+uint32_t allocateBlocks(Ext2File* fs, uint32_t count, uint32_t goal, std::vector<uint32_t>& out) {
+    uint32_t groups = fs->numBlockGroups;
+    uint32_t bpg = fs->sb.s_blocks_per_group;
+    uint32_t first = fs->sb.s_first_data_block;
+    if (goal < first || goal >= fs->sb.s_blocks_count) goal = first;
+    if (fs->freeIndex.built) return allocateExtents(fs, count, goal, out);
+    uint32_t goalGroup = (goal - first) / bpg;
+    uint32_t goalBit = (goal - first) % bpg;
+
+    std::vector<uint8_t> bitmap(fs->blockSize);
+    uint32_t got = 0;
+    // the goal group is visited twice: from goalBit on first, the bits
+    // before it last
+    for (uint32_t n = 0; n <= groups && got < count; n++) {
+        uint32_t group = (goalGroup + n) % groups;
+        uint32_t start = (n == 0) ? goalBit : 0;
+        uint32_t end = (n == groups) ? goalBit : blocksInGroup(fs, group);
+        if (start >= end || fs->bgdt[group].bg_free_blocks_count == 0) continue;
+        uint32_t bitmapBlock = fs->bgdt[group].bg_block_bitmap;
+        if (!ext2ReadBlock(*fs, bitmapBlock, bitmap.data())) continue;
+
+        bool changed = false;
+        for (uint32_t i = findFirstZeroBit(bitmap.data(), end, start); i != UINT32_MAX && got < count;
+             i = findFirstZeroBit(bitmap.data(), end, i + 1)) {
+            bitmap[i / 8] |= (1 << (i % 8));
+            // bit 0 of group 0 is s_first_data_block, not block 0
+            out.push_back(first + group * bpg + i);
+            got++;
+            adjustFreeBlocks(fs, group, -1);
+            changed = true;
+        }
+        if (changed) ext2WriteBlock(*fs, bitmapBlock, bitmap.data());
+    }
+    return got;
+}
+
+// Clears the bitmap bits of `blocks`, one bitmap read/write per group,
+// and returns them to the free-extent index.
+void releaseBlocks(Ext2File* fs, const std::vector<uint32_t>& blocks) {
+    std::vector<uint32_t> freed;
+    setBlockBits(fs, blocks, false, freed);
+    if (fs->freeIndex.built) indexAddBlocks(fs, freed);
+}
+
+// Finds & marks a free data block, searching from groupHint and wrapping.
+// Full groups (by their descriptor) are skipped without a bitmap read.
+// Returns the block number, or 0 if the filesystem is full.
+uint32_t allocateBlock(Ext2File* fs, uint32_t groupHint = 0) {
+    std::vector<uint32_t> got;
+    uint32_t goal = fs->sb.s_first_data_block + (groupHint % fs->numBlockGroups) * fs->sb.s_blocks_per_group;
+    return allocateBlocks(fs, 1, goal, got) ? got[0] : 0;
+}
+
+// Takes one free run of up to `want` blocks out of the free-extent index
+// for a window: the run at `goal` if it holds at least `need` blocks, else
+// the smallest run of `want` (then of `need`) blocks, searching groups
+// forward from the goal's, else the largest run in the first non-empty
+// group. Returns false if no block is free.
+static bool reserveWindow(Ext2File* fs, uint32_t goal, uint32_t need, uint32_t want, Reservation& r) {
+    FreeExtentIndex& fx = fs->freeIndex;
+    uint32_t groups = fs->numBlockGroups;
+    uint32_t goalGroup = (goal - fs->sb.s_first_data_block) / fs->sb.s_blocks_per_group;
+    auto grab = [&](uint32_t g, uint32_t start, uint32_t len) {
+        extentRemove(fx.groups[g], start, len);
+        r.start = start;
+        r.len = len;
+        return true;
+    };
+
+    GroupExtents& gg = fx.groups[goalGroup];
+    auto at = gg.byStart.upper_bound(goal);
+    if (at != gg.byStart.begin()) {
+        --at;
+        uint32_t avail = at->first + at->second > goal ? at->first + at->second - goal : 0;
+        if (avail >= need) return grab(goalGroup, goal, std::min(avail, want));
+    }
+    for (uint32_t min : {want, need}) {
+        for (uint32_t n = 0; n < groups; n++) {
+            uint32_t g = (goalGroup + n) % groups;
+            auto fit = fx.groups[g].byLen.lower_bound({min, 0});
+            if (fit != fx.groups[g].byLen.end()) return grab(g, fit->second, std::min(fit->first, want));
+        }
+    }
+    for (uint32_t n = 0; n < groups; n++) {
+        uint32_t g = (goalGroup + n) % groups;
+        if (!fx.groups[g].byLen.empty()) {
+            auto big = std::prev(fx.groups[g].byLen.end());
+            return grab(g, big->second, big->first);
+        }
+    }
+    return false;
+}
+
+// Puts what is left of a window back into the free-extent index.
+static void dropWindow(Ext2File* fs, Reservation& r) {
+    if (r.len == 0) return;
+    uint32_t g = (r.start - fs->sb.s_first_data_block) / fs->sb.s_blocks_per_group;
+    extentAdd(fs->freeIndex.groups[g], r.start, r.len);
+    r.len = 0;
+}
+
+// Releases inode iNum's reservation window. Call it when done writing a
+// file (ext2Close releases every window).
+void releaseReservation(Ext2File* fs, uint32_t iNum) {
+    auto it = fs->rsv.windows.find(iNum);
+    if (it == fs->rsv.windows.end()) return;
+    if (fs->freeIndex.built) dropWindow(fs, it->second);
+    fs->rsv.windows.erase(it);
+}
+
+// allocateBlocks for a file: blocks come from inode iNum's reservation
+// window when the write continues where the last one stopped (`goal` is
+// the block after it), from a new, larger window otherwise. Falls back to
+// plain allocateBlocks without the free-extent index, for directories
+// when s_prealloc_dir_blocks is 0, and for whatever a window cannot hold.
+uint32_t allocateReserved(Ext2File* fs, uint32_t iNum, bool isDir, uint32_t count, uint32_t goal,
+                          std::vector<uint32_t>& out) {
+    uint32_t base = isDir ? fs->sb.s_prealloc_dir_blocks : fs->sb.s_prealloc_blocks;
+    if (!isDir && base == 0) base = EXT2_DEFAULT_RESERVE_BLOCKS;
+    if (!fs->freeIndex.built || !fs->rsv.enabled || base == 0) return allocateBlocks(fs, count, goal, out);
+    if (goal < fs->sb.s_first_data_block || goal >= fs->sb.s_blocks_count) goal = fs->sb.s_first_data_block;
+
+    Reservation& r = fs->rsv.windows[iNum];
+    bool sequential = r.size != 0 && goal == r.next;
+    if (!sequential) {
+        dropWindow(fs, r);
+        r.size = base;
+    }
+    if (r.len < count || r.start != goal) {
+        dropWindow(fs, r);
+        if (sequential) r.size = std::min(r.size * 2, EXT2_MAX_RESERVE_BLOCKS);
+        reserveWindow(fs, goal, count, std::max(count, r.size), r);
+        fs->rsv.refills++;
+    }
+
+    uint32_t take = std::min(count, r.len);
+    std::vector<uint32_t> picked, changed, unread;
+    for (uint32_t i = 0; i < take; i++) picked.push_back(r.start + i);
+    r.start += take;
+    r.len -= take;
+    setBlockBits(fs, picked, true, changed, &unread);
+    indexAddBlocks(fs, unread); // still free, just not markable now
+    fs->rsv.used += changed.size();
+    out.insert(out.end(), changed.begin(), changed.end());
+    uint32_t got = (uint32_t)changed.size();
+    if (got < count) got += allocateBlocks(fs, count - got, r.start, out);
+    if (!out.empty()) r.next = out.back() + 1;
+    return got;
+}
+
+// Where logical block b lives in the block tree: returns the number of
+// indirect levels above it (0 for a direct block) and sets `rel` to its
+// index within that level's tree (the i_block slot for direct blocks).
+static int blockTreePath(uint32_t k, uint32_t b, uint64_t& rel) {
+    rel = b;
+    if (rel < 12) return 0;
+    rel -= 12;
+    uint64_t span = k;
+    for (int level = 1; level <= 3; level++) {
+        if (rel < span) return level;
+        rel -= span;
+        span *= k;
+    }
+    return -1;
+}
+
+// Writes `count` consecutive logical blocks starting at `first` from buf.
+// Missing data and indirect blocks are counted first and reserved in a
+// single allocateReserved call (goal: just past the block before `first`,
+// or the inode's group; the first data block if fs->localPlacement is
+// off), so a large extending write touches each bitmap block once and
+// each indirect block once. Updates inode size and i_blocks in
+// *inode; the caller writes the inode back. Returns 0, or -1 if the range
+// is past the triple-indirect limit or the disk is full (nothing changed).
+int writeFileBlocks(Ext2File* fs, uint32_t iNum, Inode* inode, uint32_t first, uint32_t count, const void* buf) {
+    uint32_t k = fs->blockSize / sizeof(uint32_t);
+    uint64_t rel;
+    if (count == 0) return 0;
+    if (blockTreePath(k, first + count - 1, rel) < 0 || first + count < first) {
+        std::cerr << "writeFileBlocks(): block past the triple-indirect limit\n";
+        return -1;
+    }
+
+    // Pass 1: count blocks to allocate. A missing indirect block is
+    // identified by (level, depth, range it covers) so it is counted once.
+    std::set<std::tuple<int, int, uint64_t>> newNodes;
+    uint32_t needData = 0;
+    for (uint32_t b = first; b < first + count; b++) {
+        int levels = blockTreePath(k, b, rel);
+        if (levels == 0) {
+            if (inode->i_block[rel] == 0) needData++;
+            continue;
+        }
+        uint32_t ptr = inode->i_block[11 + levels];
+        uint64_t span = 1;
+        for (int d = 1; d < levels; d++) span *= k;
+        for (int d = 0; d < levels; d++, span /= k) {
+            if (ptr == 0) {
+                newNodes.insert(std::make_tuple(levels, d, rel / (span * k)));
+                continue;
+            }
+            uint32_t runLen;
+            ptr = lookupIndirect(fs, ptr, (uint32_t)((rel / span) % k), runLen);
+        }
+        if (ptr == 0) needData++;
+    }
+
+    std::vector<uint32_t> pool;
+    uint32_t need = needData + (uint32_t)newNodes.size();
+    if (need > 0) {
+        uint32_t goal = 0;
+        if (first > 0) goal = resolveFileBlock(fs, inode, first - 1);
+        if (!fs->localPlacement) goal = fs->sb.s_first_data_block;
+        else if (goal != 0) goal++;
+        else goal = fs->sb.s_first_data_block +
+                    ((iNum - 1) / fs->sb.s_inodes_per_group) * fs->sb.s_blocks_per_group;
+        if (allocateReserved(fs, iNum, (inode->i_mode & 0xF000) == 0x4000, need, goal, pool) < need) {
+            releaseBlocks(fs, pool);
+            return -1; // disk full
+        }
+    }
+
+    // Pass 2: hand out the reserved blocks in tree order (an indirect block
+    // just ahead of the data it maps), editing indirect blocks in memory.
+    size_t nextFree = 0;
+    std::map<uint32_t, std::vector<uint32_t>> nodes; // physical -> entries
+    std::set<uint32_t> dirtyNodes;
+    auto loadNode = [&](uint32_t phys, bool fresh) -> std::vector<uint32_t>& {
+        auto it = nodes.find(phys);
+        if (it != nodes.end()) return it->second;
+        std::vector<uint32_t>& e = nodes[phys];
+        e.assign(k, 0);
+        if (!fresh) ext2ReadBlock(*fs, phys, e.data());
+        return e;
+    };
+
+    const uint8_t* src = reinterpret_cast<const uint8_t*>(buf);
+    bool ok = true;
+    for (uint32_t b = first; b < first + count; b++) {
+        int levels = blockTreePath(k, b, rel);
+        uint32_t* slot = levels == 0 ? &inode->i_block[rel] : &inode->i_block[11 + levels];
+        uint32_t owner = 0; // indirect block holding *slot, 0 for the inode
+        uint64_t span = 1;
+        for (int d = 1; d < levels; d++) span *= k;
+        for (int d = 0; d < levels; d++, span /= k) {
+            bool fresh = (*slot == 0);
+            if (fresh) {
+                *slot = pool[nextFree++];
+                if (owner) dirtyNodes.insert(owner);
+                dirtyNodes.insert(*slot);
+            }
+            owner = *slot;
+            slot = &loadNode(owner, fresh)[(rel / span) % k];
+        }
+        if (*slot == 0) {
+            *slot = pool[nextFree++];
+            if (owner) dirtyNodes.insert(owner);
+        }
+        ok &= ext2WriteBlock(*fs, *slot, src + (size_t)(b - first) * fs->blockSize);
+    }
+    for (uint32_t phys : dirtyNodes) ok &= ext2WriteBlock(*fs, phys, nodes[phys].data());
+
+    inode->i_blocks += (uint32_t)pool.size() * (fs->blockSize / 512);
+    uint64_t end = (uint64_t)(first + count) * fs->blockSize;
+    if (inodeSize(inode) < end) {
+        inode->i_size = (uint32_t)end;
+        if ((inode->i_mode & 0xF000) == 0x8000) inode->i_dir_acl = (uint32_t)(end >> 32);
+    }
+    return ok ? 0 : -1;
+}
+
+int writeBlockToFile(Ext2File* fs, uint32_t iNum, Inode* inode, uint32_t bNum, const void* buf) {
+    return writeFileBlocks(fs, iNum, inode, bNum, 1, buf);
 }
 
 
@@ -970,11 +3253,27 @@ return -1;
 
 // --------------------------- STEP 6: Directory Functions ---------------------------
 
+// One in-use entry of the directory block currently loaded. `name` points
+// into that block's data, so it is only valid until the next block loads.
+struct DirSlot {
+    uint32_t inode;
+    uint32_t end;       // byte offset just past this entry (offset + rec_len)
+    const char* name;
+    uint8_t nameLen;
+    uint8_t fileType;
+};
+
 // A structure to help traverse a directory’s contents
 struct Directory {
     Ext2File* fs;              // filesystem reference
     Inode inode;               // a copy of the inode
     uint32_t cursor = 0;       // logical byte offset
+    // the directory block holding `cursor`, parsed once into `slots`
+    uint32_t loadedBlock = UINT32_MAX;
+    const uint8_t* data = nullptr;  // mapped block, or blockBuf
+    std::vector<uint8_t> blockBuf;
+    std::vector<DirSlot> slots;
+    size_t nextSlot = 0;
 };
 
 // Function: openDir
@@ -988,39 +3287,79 @@ Directory* openDir(Ext2File* fs, uint32_t iNum) {
         return nullptr;
     }
     dir->cursor = 0;
+    dir->blockBuf.resize(fs->blockSize);
     return dir;
 }
 
+// Reads directory block `blockIdx` once and walks its rec_len chain,
+// keeping the in-use entries. A rec_len that is too small or runs past the
+// block ends the chain there. Also starts read-ahead of the next block.
+static bool loadDirBlock(Directory* d, uint32_t blockIdx) {
+    struct DirEntry {
+        uint32_t inode;
+        uint16_t rec_len;
+        uint8_t name_len;
+        uint8_t file_type;
+        char name[];
+    } __attribute__((packed));
+
+    Ext2File* fs = d->fs;
+    d->loadedBlock = UINT32_MAX;
+    d->slots.clear();
+    d->nextSlot = 0;
+    d->data = fetchBlockPtrFromFile(fs, &d->inode, blockIdx);
+    if (!d->data) {
+        if (fetchBlockFromFile(fs, &d->inode, blockIdx, d->blockBuf.data()) != 0)
+            return false;
+        d->data = d->blockBuf.data();
+    }
+
+    uint32_t base = blockIdx * fs->blockSize;
+    for (uint32_t off = 0; off + 8 <= fs->blockSize;) {
+        const DirEntry* e = reinterpret_cast<const DirEntry*>(d->data + off);
+        if (e->rec_len < 8 || off + e->rec_len > fs->blockSize || 8u + e->name_len > e->rec_len)
+            break;
+        off += e->rec_len;
+        if (e->inode != 0)
+            d->slots.push_back({e->inode, base + off, e->name, e->name_len, e->file_type});
+    }
+    d->loadedBlock = blockIdx;
+
+    if ((uint64_t)(blockIdx + 1) * fs->blockSize < d->inode.i_size) {
+        uint32_t next = resolveFileBlock(fs, &d->inode, blockIdx + 1);
+        if (next) ext2WillNeed(*fs, next, 1);
+    }
+    return true;
+}
+
 // Function: getNextDirent
 // Description: Iterates through directory blocks and returns the next valid entry (name and iNum)
 // Requirement: Step 6 - this is the core of directory iteration using EXT2 structures
-bool getNextDirent(Directory* d, uint32_t &iNum, char* name) {
+// Each directory block is read and parsed once; later calls are served
+// from the parsed entries. fileType, when given, receives the entry's
+// file type byte (EXT2_FT_*, 0 if the filesystem does not record it).
+bool getNextDirent(Directory* d, uint32_t &iNum, char* name, uint8_t* fileType = nullptr) {
+    uint32_t bs = d->fs->blockSize;
     while (d->cursor < d->inode.i_size) {
-        uint8_t block[4096];
-        uint32_t blockOffset = d->cursor / d->fs->blockSize;
-        uint32_t innerOffset = d->cursor % d->fs->blockSize;
-
-        if (fetchBlockFromFile(d->fs, &d->inode, blockOffset, block) != 0)
-            return false;
-
-        struct DirEntry {
-            uint32_t inode;
-            uint16_t rec_len;
-            uint8_t name_len;
-            uint8_t file_type;
-            char name[];
-        } __attribute__((packed));
-
-        DirEntry* e = reinterpret_cast<DirEntry*>(block + innerOffset);
-        if (e->inode != 0) {
-            iNum = e->inode;
-            std::memcpy(name, e->name, e->name_len);
-            name[e->name_len] = '\0';
-            d->cursor += e->rec_len;
-            return true;
-        } else {
-            d->cursor += e->rec_len;
+        uint32_t blockIdx = d->cursor / bs;
+        if (blockIdx != d->loadedBlock) {
+            if (!loadDirBlock(d, blockIdx))
+                return false;
+            // resume after the entry the cursor points past
+            while (d->nextSlot < d->slots.size() && d->slots[d->nextSlot].end <= d->cursor)
+                d->nextSlot++;
         }
+        if (d->nextSlot == d->slots.size()) {
+            d->cursor = (blockIdx + 1) * bs;
+            continue;
+        }
+        const DirSlot& s = d->slots[d->nextSlot++];
+        iNum = s.inode;
+        std::memcpy(name, s.name, s.nameLen);
+        name[s.nameLen] = '\0';
+        if (fileType) *fileType = s.fileType;
+        d->cursor = s.end;
+        return true;
     }
     return false;
 }
@@ -1030,6 +3369,7 @@ bool getNextDirent(Directory* d, uint32_t &iNum, char* name) {
 // Requirement: Step 6 - allows re-reading the contents of a directory
 void rewindDir(Directory* d) {
     d->cursor = 0;
+    d->loadedBlock = UINT32_MAX;
 }
 
 // Function: closeDir
@@ -1040,35 +3380,1581 @@ void closeDir(Directory* d) {
 }
 
 
+// --------------------------- Path lookup ---------------------------
+//
+// lookupPath resolves "/a/b/c" one component at a time. Each step asks
+// the dentry cache first and only scans the directory on a miss; both
+// hits and misses ("no such name") are remembered, bounded by LRU.
+
+void setDentryCacheSize(Ext2File* fs, size_t names) {
+    std::lock_guard<std::mutex> lock(fs->dcache.lock);
+    fs->dcache.entries.capacity = names;
+    while (fs->dcache.entries.overFull()) fs->dcache.entries.popOldest();
+}
 
+// Drops the cached result for `name` in directory `parent`, after an
+// entry is added to or removed from it.
+void dcacheForget(Ext2File* fs, uint32_t parent, const std::string& name) {
+    std::lock_guard<std::mutex> lock(fs->dcache.lock);
+    fs->dcache.entries.erase(DentryKey{parent, name});
+}
 
+// Directory hashing (dir_index). Hash versions are those of the htree
+// root; the *_UNSIGNED variants apply when the superblock says the
+// filesystem was created on a platform with unsigned char.
+const uint32_t EXT2_FEATURE_COMPAT_DIR_INDEX = 0x0020;
+const uint32_t EXT2_INDEX_FL = 0x00001000;
+const uint32_t EXT2_FLAGS_UNSIGNED_HASH = 0x0002;
+
+enum DxHashVersion {
+    DX_HASH_LEGACY = 0,
+    DX_HASH_HALF_MD4 = 1,
+    DX_HASH_TEA = 2,
+    DX_HASH_LEGACY_UNSIGNED = 3,
+    DX_HASH_HALF_MD4_UNSIGNED = 4,
+    DX_HASH_TEA_UNSIGNED = 5,
+};
 
+static uint32_t rol32(uint32_t x, int s) { return (x << s) | (x >> (32 - s)); }
 
+static void teaTransform(uint32_t buf[4], const uint32_t in[4]) {
+    uint32_t sum = 0;
+    uint32_t b0 = buf[0], b1 = buf[1];
+    for (int n = 0; n < 16; n++) {
+        sum += 0x9E3779B9;
+        b0 += ((b1 << 4) + in[0]) ^ (b1 + sum) ^ ((b1 >> 5) + in[1]);
+        b1 += ((b0 << 4) + in[2]) ^ (b0 + sum) ^ ((b0 >> 5) + in[3]);
+    }
+    buf[0] += b0;
+    buf[1] += b1;
+}
 
+static void halfMd4Transform(uint32_t buf[4], const uint32_t in[8]) {
+    auto F = [](uint32_t x, uint32_t y, uint32_t z) { return z ^ (x & (y ^ z)); };
+    auto G = [](uint32_t x, uint32_t y, uint32_t z) { return (x & y) + ((x ^ y) & z); };
+    auto H = [](uint32_t x, uint32_t y, uint32_t z) { return x ^ y ^ z; };
+    const uint32_t K2 = 013240474631U, K3 = 015666365641U;
+    uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+    a = rol32(a + F(b, c, d) + in[0], 3);  d = rol32(d + F(a, b, c) + in[1], 7);
+    c = rol32(c + F(d, a, b) + in[2], 11); b = rol32(b + F(c, d, a) + in[3], 19);
+    a = rol32(a + F(b, c, d) + in[4], 3);  d = rol32(d + F(a, b, c) + in[5], 7);
+    c = rol32(c + F(d, a, b) + in[6], 11); b = rol32(b + F(c, d, a) + in[7], 19);
+
+    a = rol32(a + G(b, c, d) + in[1] + K2, 3);  d = rol32(d + G(a, b, c) + in[3] + K2, 5);
+    c = rol32(c + G(d, a, b) + in[5] + K2, 9);  b = rol32(b + G(c, d, a) + in[7] + K2, 13);
+    a = rol32(a + G(b, c, d) + in[0] + K2, 3);  d = rol32(d + G(a, b, c) + in[2] + K2, 5);
+    c = rol32(c + G(d, a, b) + in[4] + K2, 9);  b = rol32(b + G(c, d, a) + in[6] + K2, 13);
+
+    a = rol32(a + H(b, c, d) + in[3] + K3, 3);  d = rol32(d + H(a, b, c) + in[7] + K3, 9);
+    c = rol32(c + H(d, a, b) + in[2] + K3, 11); b = rol32(b + H(c, d, a) + in[6] + K3, 15);
+    a = rol32(a + H(b, c, d) + in[1] + K3, 3);  d = rol32(d + H(a, b, c) + in[5] + K3, 9);
+    c = rol32(c + H(d, a, b) + in[0] + K3, 11); b = rol32(b + H(c, d, a) + in[4] + K3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
 
+// Packs up to num*4 name bytes into words, padded with the length.
+static void str2hashbuf(const char* msg, int len, uint32_t* buf, int num, bool isUnsigned) {
+    uint32_t pad = (uint32_t)len | ((uint32_t)len << 8);
+    pad |= pad << 16;
+    uint32_t val = pad;
+    if (len > num * 4) len = num * 4;
+    for (int i = 0; i < len; i++) {
+        int c = isUnsigned ? (int)(unsigned char)msg[i] : (int)(signed char)msg[i];
+        val = (uint32_t)c + (val << 8);
+        if (i % 4 == 3) {
+            *buf++ = val;
+            val = pad;
+            num--;
+        }
+    }
+    if (--num >= 0) *buf++ = val;
+    while (--num >= 0) *buf++ = pad;
+}
 
+// The ext2 directory hash of a name (major hash, low bit clear).
+uint32_t ext2DirHash(const char* name, int len, int version, const uint32_t seed[4]) {
+    uint32_t buf[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+    if (seed[0] | seed[1] | seed[2] | seed[3]) std::memcpy(buf, seed, sizeof(buf));
+    bool isUnsigned = version >= DX_HASH_LEGACY_UNSIGNED;
+    uint32_t in[8];
+    uint32_t hash = 0;
+    switch (version) {
+    case DX_HASH_LEGACY:
+    case DX_HASH_LEGACY_UNSIGNED: {
+        uint32_t hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+        for (int i = 0; i < len; i++) {
+            int c = isUnsigned ? (int)(unsigned char)name[i] : (int)(signed char)name[i];
+            uint32_t h = hash1 + (hash0 ^ (uint32_t)(c * 7152373));
+            if (h & 0x80000000) h -= 0x7fffffff;
+            hash1 = hash0;
+            hash0 = h;
+        }
+        hash = hash0 << 1;
+        break;
+    }
+    case DX_HASH_HALF_MD4:
+    case DX_HASH_HALF_MD4_UNSIGNED:
+        for (const char* p = name; len > 0; len -= 32, p += 32) {
+            str2hashbuf(p, len, in, 8, isUnsigned);
+            halfMd4Transform(buf, in);
+        }
+        hash = buf[1];
+        break;
+    case DX_HASH_TEA:
+    case DX_HASH_TEA_UNSIGNED:
+        for (const char* p = name; len > 0; len -= 16, p += 16) {
+            str2hashbuf(p, len, in, 4, isUnsigned);
+            teaTransform(buf, in);
+        }
+        hash = buf[0];
+        break;
+    default:
+        return 0;
+    }
+    hash &= ~1u;
+    if (hash == (0x7fffffffu << 1)) hash = (0x7fffffffu - 1) << 1; // reserved for EOF
+    return hash;
+}
 
+struct DirEntryHead {
+    uint32_t inode;
+    uint16_t rec_len;
+    uint8_t name_len;
+    uint8_t file_type;
+} __attribute__((packed));
+
+// Inode of `name` within one directory block, or 0.
+static uint32_t findInDirBlock(const uint8_t* block, uint32_t bs, const std::string& name) {
+    for (uint32_t off = 0; off + sizeof(DirEntryHead) <= bs;) {
+        const DirEntryHead* e = reinterpret_cast<const DirEntryHead*>(block + off);
+        if (e->rec_len < 8 || off + e->rec_len > bs) break;
+        if (e->inode != 0 && e->name_len == name.size() &&
+            std::memcmp(block + off + sizeof(DirEntryHead), name.data(), name.size()) == 0)
+            return e->inode;
+        off += e->rec_len;
+    }
+    return 0;
+}
 
+// Logical block `bNum` of a directory, mapped in place or copied to buf.
+static const uint8_t* dirBlock(Ext2File* fs, const Inode* dir, uint32_t bNum, std::vector<uint8_t>& buf) {
+    if (const uint8_t* p = fetchBlockPtrFromFile(fs, dir, bNum)) return p;
+    buf.resize(fs->blockSize);
+    if (fetchBlockFromFile(fs, const_cast<Inode*>(dir), bNum, buf.data()) != 0) return nullptr;
+    return buf.data();
+}
 
+// Scans every block of the directory for `name`. Returns the inode, 0.
+uint32_t linearLookup(Ext2File* fs, const Inode* dir, const std::string& name) {
+    std::vector<uint8_t> buf;
+    uint32_t blocks = dir->i_size / fs->blockSize;
+    for (uint32_t b = 0; b < blocks; b++) {
+        const uint8_t* block = dirBlock(fs, dir, b, buf);
+        if (!block) return 0;
+        if (uint32_t iNum = findInDirBlock(block, fs->blockSize, name)) return iNum;
+    }
+    return 0;
+}
 
+// Looks `name` up through the directory's htree: the root and at most two
+// index levels are binary-searched by hash, then only the leaf blocks that
+// can hold that hash are scanned. Sets `usable` to false (and returns 0)
+// when the index is missing or not understood, so the caller can fall
+// back to linearLookup.
+uint32_t htreeLookup(Ext2File* fs, const Inode* dir, const std::string& name, bool& usable) {
+    struct DxRootInfo {
+        uint32_t reserved_zero;
+        uint8_t hash_version;
+        uint8_t info_length;
+        uint8_t indirect_levels;
+        uint8_t unused_flags;
+    } __attribute__((packed));
+    struct DxEntry {
+        uint32_t hash; // for entry 0: uint16 limit, uint16 count
+        uint32_t block;
+    } __attribute__((packed));
+    struct Frame {
+        std::vector<uint8_t> data; // index block (copied: frames outlive reads)
+        const DxEntry* entries;
+        uint32_t count;
+        uint32_t at;
+    };
 
+    usable = false;
+    if (!(fs->sb.s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) || !(dir->i_flags & EXT2_INDEX_FL))
+        return 0;
+    uint32_t bs = fs->blockSize;
+    std::vector<uint8_t> tmp;
+    const uint8_t* root = dirBlock(fs, dir, 0, tmp);
+    if (!root) return 0;
+
+    // the root block starts with "." (12 bytes) and ".." whose rec_len
+    // covers the rest of the block; the index info follows at 24
+    if (name == "." || name == "..") {
+        usable = true; // not hashed: they are the root block's own entries
+        return findInDirBlock(root, bs, name);
+    }
+    const DxRootInfo* info = reinterpret_cast<const DxRootInfo*>(root + 24);
+    if (info->reserved_zero != 0 || info->indirect_levels > 1 || info->info_length != 8 ||
+        info->hash_version > DX_HASH_TEA)
+        return 0;
+    int version = info->hash_version;
+    if (fs->sb.s_flags & EXT2_FLAGS_UNSIGNED_HASH) version += 3;
+    uint32_t hash = ext2DirHash(name.data(), (int)name.size(), version, fs->sb.s_hash_seed);
+
+    // descend from the root, recording the path so collisions can walk on
+    std::vector<Frame> path(info->indirect_levels + 1);
+    uint32_t offset = 24 + info->info_length;
+    for (size_t level = 0; level < path.size(); level++) {
+        Frame& f = path[level];
+        f.data.assign(root, root + bs);
+        f.entries = reinterpret_cast<const DxEntry*>(f.data.data() + offset);
+        uint16_t limitCount[2];
+        std::memcpy(limitCount, f.entries, sizeof(limitCount));
+        f.count = limitCount[1];
+        if (f.count == 0 || f.count > limitCount[0] || offset + limitCount[0] * sizeof(DxEntry) > bs)
+            return 0;
+        // last entry whose hash <= target (entry 0 covers everything below)
+        uint32_t lo = 1, hi = f.count;
+        while (lo < hi) {
+            uint32_t mid = (lo + hi) / 2;
+            if (f.entries[mid].hash > hash) hi = mid;
+            else lo = mid + 1;
+        }
+        f.at = lo - 1;
+        if (level + 1 < path.size()) {
+            // interior node: an empty dirent spanning the block, then entries
+            root = dirBlock(fs, dir, f.entries[f.at].block & 0x0FFFFFFF, tmp);
+            if (!root) return 0;
+            offset = 8;
+        }
+    }
+    usable = true;
+
+    for (;;) {
+        Frame& leafFrame = path.back();
+        const uint8_t* leaf = dirBlock(fs, dir, leafFrame.entries[leafFrame.at].block & 0x0FFFFFFF, tmp);
+        if (!leaf) return 0;
+        if (uint32_t iNum = findInDirBlock(leaf, bs, name)) return iNum;
+
+        // step to the next leaf; it can only hold our name if its starting
+        // hash is ours with the collision bit set
+        int level = (int)path.size() - 1;
+        while (level >= 0 && path[level].at + 1 >= path[level].count) level--;
+        if (level < 0) return 0;
+        path[level].at++;
+        uint32_t next = path[level].entries[path[level].at].hash;
+        if ((next & ~1u) != hash || !(next & 1)) return 0;
+        for (size_t l = level + 1; l < path.size(); l++) {
+            const Frame& up = path[l - 1];
+            const uint8_t* node = dirBlock(fs, dir, up.entries[up.at].block & 0x0FFFFFFF, tmp);
+            if (!node) return 0;
+            Frame& f = path[l];
+            f.data.assign(node, node + bs);
+            f.entries = reinterpret_cast<const DxEntry*>(f.data.data() + 8);
+            uint16_t limitCount[2];
+            std::memcpy(limitCount, f.entries, sizeof(limitCount));
+            f.count = limitCount[1];
+            f.at = 0;
+        }
+    }
+}
 
+// Enables per-directory Bloom filters for up to `maxDirs` directories at
+// the given false-positive rate (e.g. 0.01); maxDirs 0 turns them off.
+// Filters already built keep the rate they were built with.
+void setDirFilter(Ext2File* fs, size_t maxDirs, double fpRate = 0.01) {
+    std::lock_guard<std::mutex> lock(fs->dfilter.lock);
+    fs->dfilter.filters.capacity = maxDirs;
+    if (fpRate > 0 && fpRate < 1) fs->dfilter.fpRate = fpRate;
+    while (fs->dfilter.filters.overFull()) fs->dfilter.filters.popOldest();
+}
+
+// Two independent 64-bit hashes of a name; probe i is h1 + i*h2.
+static void dirFilterHash(const char* name, size_t len, uint64_t& h1, uint64_t& h2) {
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++) h = (h ^ (uint8_t)name[i]) * 1099511628211ULL;
+    h1 = h;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h2 = h | 1;
+}
+
+static void dirFilterInsert(DirFilter& f, const char* name, size_t len) {
+    uint64_t h1, h2;
+    dirFilterHash(name, len, h1, h2);
+    uint64_t nbits = (uint64_t)f.bits.size() * 64;
+    for (uint32_t i = 0; i < f.hashes; i++) {
+        uint64_t bit = (h1 + i * h2) % nbits;
+        f.bits[bit / 64] |= 1ULL << (bit % 64);
+    }
+    f.names++;
+}
+
+static bool dirFilterMayContain(const DirFilter& f, const std::string& name) {
+    uint64_t h1, h2;
+    dirFilterHash(name.data(), name.size(), h1, h2);
+    uint64_t nbits = (uint64_t)f.bits.size() * 64;
+    for (uint32_t i = 0; i < f.hashes; i++) {
+        uint64_t bit = (h1 + i * h2) % nbits;
+        if (!(f.bits[bit / 64] & (1ULL << (bit % 64)))) return false;
+    }
+    return true;
+}
+
+// Scans the whole directory once, building its filter from every name,
+// and returns the inode of `name` (0 if absent). Sized with headroom so
+// later addDirent calls do not push it past its false-positive target.
+static uint32_t scanAndBuildFilter(Ext2File* fs, uint32_t dirINum, const Inode* dir, const std::string& name) {
+    std::vector<std::pair<const char*, uint8_t>> names;
+    std::vector<std::vector<uint8_t>> blocks; // keeps names alive
+    uint32_t found = 0;
+    uint32_t count = dir->i_size / fs->blockSize;
+    for (uint32_t b = 0; b < count; b++) {
+        blocks.emplace_back(fs->blockSize);
+        if (fetchBlockFromFile(fs, const_cast<Inode*>(dir), b, blocks.back().data()) != 0) return linearLookup(fs, dir, name);
+        const uint8_t* block = blocks.back().data();
+        for (uint32_t off = 0; off + sizeof(DirEntryHead) <= fs->blockSize;) {
+            const DirEntryHead* e = reinterpret_cast<const DirEntryHead*>(block + off);
+            if (e->rec_len < 8 || off + e->rec_len > fs->blockSize) break;
+            if (e->inode != 0) {
+                const char* n = reinterpret_cast<const char*>(block + off + sizeof(DirEntryHead));
+                names.push_back({n, e->name_len});
+                if (!found && e->name_len == name.size() && std::memcmp(n, name.data(), name.size()) == 0)
+                    found = e->inode;
+            }
+            off += e->rec_len;
+        }
+    }
+
+    DirFilterCache& dfc = fs->dfilter;
+    std::lock_guard<std::mutex> lock(dfc.lock);
+    if (dfc.filters.capacity == 0) return found;
+    DirFilter f;
+    double bitsPerName = -std::log(dfc.fpRate) / (std::log(2.0) * std::log(2.0));
+    f.hashes = std::max(1u, (uint32_t)std::lround(bitsPerName * std::log(2.0)));
+    f.capacity = std::max<uint32_t>(16, (uint32_t)names.size() + (uint32_t)names.size() / 4);
+    f.bits.assign((size_t)((f.capacity * bitsPerName + 63) / 64), 0);
+    for (auto& n : names) dirFilterInsert(f, n.first, n.second);
+    dfc.filters.erase(dirINum);
+    dfc.filters.insert(dirINum, std::move(f));
+    while (dfc.filters.overFull()) dfc.filters.popOldest();
+    return found;
+}
 
+// Records the result of a lookup (0 for "absent") in the dentry cache.
+static void dcacheStore(Ext2File* fs, uint32_t parent, const std::string& name, uint32_t child) {
+    DentryCache& dc = fs->dcache;
+    DentryKey key{parent, name};
+    std::lock_guard<std::mutex> lock(dc.lock);
+    if (dc.entries.capacity > 0 && !dc.entries.peek(key)) {
+        dc.entries.insert(key, child);
+        while (dc.entries.overFull()) dc.entries.popOldest();
+    }
+}
+
+// Inode number of `name` in directory `dirINum`, or 0 if there is none.
+// Indexed directories are searched through their htree, others linearly
+// (behind the directory's Bloom filter when filters are enabled).
+uint32_t lookupName(Ext2File* fs, uint32_t dirINum, const std::string& name) {
+    DentryCache& dc = fs->dcache;
+    DentryKey key{dirINum, name};
+    {
+        std::lock_guard<std::mutex> lock(dc.lock);
+        if (uint32_t* child = dc.entries.find(key)) {
+            dc.hits++;
+            return *child;
+        }
+        dc.misses++;
+    }
+
+    Inode dir;
+    if (fetchInode(fs, dirINum, &dir) != 0) return 0;
+    bool indexed;
+    uint32_t found = htreeLookup(fs, &dir, name, indexed);
+    if (!indexed) {
+        DirFilterCache& dfc = fs->dfilter;
+        int verdict = -1; // no filter
+        if (dfc.filters.capacity > 0) {
+            std::lock_guard<std::mutex> lock(dfc.lock);
+            if (const DirFilter* f = dfc.filters.find(dirINum)) {
+                dfc.queries++;
+                verdict = dirFilterMayContain(*f, name) ? 1 : 0;
+                if (verdict == 0) dfc.rejected++;
+            }
+        }
+        if (verdict == 0) {
+            found = 0;
+        } else if (verdict == 1) {
+            found = linearLookup(fs, &dir, name);
+            if (found == 0) {
+                std::lock_guard<std::mutex> lock(dfc.lock);
+                dfc.falsePositives++;
+            }
+        } else if (dfc.filters.capacity > 0) {
+            found = scanAndBuildFilter(fs, dirINum, &dir, name);
+        } else {
+            found = linearLookup(fs, &dir, name);
+        }
+    }
+
+    dcacheStore(fs, dirINum, name, found);
+    return found;
+}
+
+// Adds entry `name` -> childINum to directory dirINum, in the first block
+// with room (splitting an entry's slack space) or in a new block at the
+// end. Keeps the dentry cache and the directory's Bloom filter current.
+// The htree index is not maintained: an indexed directory has
+// EXT2_INDEX_FL cleared and is from then on searched linearly, which is
+// what the kernel and e2fsck expect of an unindexed directory. The caller
+// owns the child's link count. Returns 0, or -1 if the name is invalid,
+// already present, or there is no space.
+int addDirent(Ext2File* fs, uint32_t dirINum, const std::string& name, uint32_t childINum, uint8_t fileType = 0) {
+    if (childINum == 0 || name.empty() || name.size() > 255 || name.find('/') != std::string::npos) return -1;
+    if (lookupName(fs, dirINum, name) != 0) return -1;
+    Inode dir;
+    if (fetchInode(fs, dirINum, &dir) != 0 || (dir.i_mode & 0xF000) != 0x4000) return -1;
+    if (!(fs->sb.s_feature_incompat & 0x0002)) fileType = 0; // no filetype feature
+
+    uint32_t bs = fs->blockSize;
+    uint16_t need = (uint16_t)((sizeof(DirEntryHead) + name.size() + 3) & ~3u);
+    std::vector<uint8_t> buf(bs);
+    auto place = [&](uint32_t off, uint16_t recLen) {
+        DirEntryHead* e = reinterpret_cast<DirEntryHead*>(buf.data() + off);
+        e->inode = childINum;
+        e->rec_len = recLen;
+        e->name_len = (uint8_t)name.size();
+        e->file_type = fileType;
+        std::memcpy(buf.data() + off + sizeof(DirEntryHead), name.data(), name.size());
+    };
+
+    bool done = false;
+    uint32_t blocks = dir.i_size / bs;
+    for (uint32_t b = 0; b < blocks && !done; b++) {
+        if (fetchBlockFromFile(fs, &dir, b, buf.data()) != 0) continue;
+        for (uint32_t off = 0; off + sizeof(DirEntryHead) <= bs;) {
+            DirEntryHead* e = reinterpret_cast<DirEntryHead*>(buf.data() + off);
+            if (e->rec_len < 8 || off + e->rec_len > bs) break;
+            uint16_t used = e->inode ? (uint16_t)((sizeof(DirEntryHead) + e->name_len + 3) & ~3u) : 0;
+            if (e->rec_len - used >= need) {
+                uint16_t rest = e->rec_len - used;
+                if (used) e->rec_len = used;
+                place(off + used, rest);
+                done = writeBlockToFile(fs, dirINum, &dir, b, buf.data()) == 0;
+                break;
+            }
+            off += e->rec_len;
+        }
+    }
+    if (!done) {
+        std::fill(buf.begin(), buf.end(), 0);
+        place(0, (uint16_t)bs);
+        if (writeBlockToFile(fs, dirINum, &dir, blocks, buf.data()) != 0) return -1;
+    }
+    dir.i_flags &= ~EXT2_INDEX_FL;
+    writeInode(fs, dirINum, &dir);
+
+    dcacheForget(fs, dirINum, name);
+    DirFilterCache& dfc = fs->dfilter;
+    std::lock_guard<std::mutex> lock(dfc.lock);
+    if (DirFilter* f = dfc.filters.peek(dirINum)) {
+        if (f->names >= f->capacity)
+            dfc.filters.erase(dirINum); // full: rebuilt by the next scan
+        else
+            dirFilterInsert(*f, name.data(), name.size());
+    }
+    return 0;
+}
+
+// Resolves a slash-separated path to an inode number, or 0 if a component
+// is missing or is not a directory. Absolute paths start at the root;
+// relative ones at `cwd`. "." and ".." are ordinary directory entries.
+// Symbolic links are not followed.
+uint32_t lookupPath(Ext2File* fs, const std::string& path, uint32_t cwd = 2) {
+    uint32_t cur = (!path.empty() && path[0] == '/') ? 2 : cwd;
+    size_t pos = 0;
+    while (pos < path.size()) {
+        size_t end = path.find('/', pos);
+        if (end == std::string::npos) end = path.size();
+        if (end > pos) {
+            Inode dir;
+            if (fetchInode(fs, cur, &dir) != 0 || (dir.i_mode & 0xF000) != 0x4000) return 0;
+            cur = lookupName(fs, cur, path.substr(pos, end - pos));
+            if (cur == 0) return 0;
+        }
+        pos = end + 1;
+    }
+    return cur;
+}
+
+// Resolves many paths at once. The paths are merged into a trie, so a
+// directory shared by several paths is resolved once, and every directory
+// is read at most once for all the names wanted from it: names already in
+// the dentry cache are taken from there, an indexed directory asked for
+// only a few names is probed through its htree, and otherwise one scan
+// with getNextDirent picks up all of them. Returns path -> inode, with 0
+// for paths that do not resolve (same rules as lookupPath).
+std::unordered_map<std::string, uint32_t> lookupPaths(Ext2File* fs, const std::vector<std::string>& paths,
+                                                      uint32_t cwd = 2) {
+    struct TrieNode {
+        std::unordered_map<std::string, size_t> children;
+        uint32_t iNum = 0;
+    };
+    std::vector<TrieNode> nodes(2); // node 0: "/", node 1: cwd
+    nodes[0].iNum = 2;
+    nodes[1].iNum = cwd;
+
+    std::vector<size_t> terminal(paths.size());
+    for (size_t p = 0; p < paths.size(); p++) {
+        const std::string& path = paths[p];
+        size_t node = (!path.empty() && path[0] == '/') ? 0 : 1;
+        size_t pos = 0;
+        while (pos < path.size()) {
+            size_t end = path.find('/', pos);
+            if (end == std::string::npos) end = path.size();
+            if (end > pos) {
+                std::string part = path.substr(pos, end - pos);
+                auto it = nodes[node].children.find(part);
+                if (it == nodes[node].children.end()) {
+                    nodes.emplace_back();
+                    it = nodes[node].children.emplace(std::move(part), nodes.size() - 1).first;
+                }
+                node = it->second;
+            }
+            pos = end + 1;
+        }
+        terminal[p] = node;
+    }
+
+    // nodes are created parent-first, so one forward pass resolves them
+    for (size_t n = 0; n < nodes.size(); n++) {
+        TrieNode& node = nodes[n];
+        if (node.iNum == 0 || node.children.empty()) continue;
+        Inode dir;
+        if (fetchInode(fs, node.iNum, &dir) != 0 || (dir.i_mode & 0xF000) != 0x4000) continue;
+
+        std::unordered_map<std::string, size_t> wanted;
+        for (auto& c : node.children) {
+            DentryCache& dc = fs->dcache;
+            std::lock_guard<std::mutex> lock(dc.lock);
+            if (uint32_t* hit = dc.entries.find(DentryKey{node.iNum, c.first})) {
+                dc.hits++;
+                nodes[c.second].iNum = *hit;
+            } else {
+                dc.misses++;
+                wanted.insert(c);
+            }
+        }
+        if (wanted.empty()) continue;
+
+        bool indexed = false;
+        uint32_t dirBlocks = dir.i_size / fs->blockSize;
+        if (wanted.size() * 4 < dirBlocks) {
+            for (auto it = wanted.begin(); it != wanted.end();) {
+                bool usable;
+                uint32_t child = htreeLookup(fs, &dir, it->first, usable);
+                if (!usable) break;
+                indexed = true;
+                nodes[it->second].iNum = child;
+                dcacheStore(fs, node.iNum, it->first, child);
+                it = wanted.erase(it);
+            }
+        }
+        if (indexed || wanted.empty()) continue;
+
+        Directory* d = openDir(fs, node.iNum);
+        if (!d) continue;
+        uint32_t iNum;
+        char name[256];
+        size_t left = wanted.size();
+        while (left > 0 && getNextDirent(d, iNum, name)) {
+            auto it = wanted.find(name);
+            if (it != wanted.end() && nodes[it->second].iNum == 0) {
+                nodes[it->second].iNum = iNum;
+                left--;
+            }
+        }
+        closeDir(d);
+        for (auto& w : wanted) dcacheStore(fs, node.iNum, w.first, nodes[w.second].iNum);
+    }
+
+    std::unordered_map<std::string, uint32_t> result;
+    for (size_t p = 0; p < paths.size(); p++) result[paths[p]] = nodes[terminal[p]].iNum;
+    return result;
+}
+
+// --------------------------- Async block reads ---------------------------
+//
+// An AsyncReader queues many ext2 block reads and keeps up to `depth` of
+// them in flight at once. Reads go through io_uring when the kernel allows
+// it, otherwise through a small thread pool doing ordinary ext2ReadBlock
+// calls. Completions are handed back in batches by asyncReap, in the order
+// the device finished them, not the order they were queued.
+
+struct BlockRead {
+    uint32_t blockIndex = 0; // ext2 block number
+    void* buf = nullptr;     // blockSize bytes, owned by the caller
+    uint64_t tag = 0;        // caller cookie, returned untouched
+    int result = 0;          // 0 on success, -1 on error (buf is zeroed)
+};
+
+struct AsyncReader {
+    Ext2File* fs = nullptr;
+    unsigned depth = 0;
+    bool usingUring = false;
+
+    std::deque<BlockRead> queued;   // waiting for a free slot
+    std::vector<BlockRead> done;    // finished, not yet reaped
+    size_t inFlight = 0;
+
+    // io_uring: one slot per in-flight block, one SQE per image segment
+    struct Slot {
+        BlockRead req;
+        std::vector<iovec> segs;
+        std::vector<uint64_t> segOffsets;
+        unsigned pending = 0;
+        bool failed = false;
+    };
+    int ringFd = -1;
+    void* sqRing = nullptr;
+    void* cqRing = nullptr;
+    size_t sqRingSize = 0, cqRingSize = 0;
+    io_uring_sqe* sqes = nullptr;
+    unsigned sqEntries = 0;
+    unsigned *sqHead = nullptr, *sqTail = nullptr, *sqMask = nullptr, *sqArray = nullptr;
+    unsigned *cqHead = nullptr, *cqTail = nullptr, *cqMask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+    std::vector<Slot> slots;
+    std::vector<unsigned> freeSlots;
+    unsigned sqesInFlight = 0;
+    unsigned unsubmitted = 0;
+
+    // thread-pool fallback
+    std::vector<std::thread> pool;
+    std::deque<BlockRead> poolWork;
+    std::mutex poolLock;
+    std::condition_variable poolWake, poolDone;
+    bool stopping = false;
+};
+
+static bool uringSetup(AsyncReader& r, unsigned entries) {
+    io_uring_params p;
+    std::memset(&p, 0, sizeof(p));
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0) return false;
+
+    r.sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r.cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single) r.sqRingSize = r.cqRingSize = std::max(r.sqRingSize, r.cqRingSize);
+
+    void* sq = mmap(nullptr, r.sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    fd, IORING_OFF_SQ_RING);
+    void* cq = sq;
+    if (sq != MAP_FAILED && !single)
+        cq = mmap(nullptr, r.cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  fd, IORING_OFF_CQ_RING);
+    void* sqes = MAP_FAILED;
+    if (sq != MAP_FAILED && cq != MAP_FAILED)
+        sqes = mmap(nullptr, p.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        if (cq != MAP_FAILED && cq != sq) munmap(cq, r.cqRingSize);
+        if (sq != MAP_FAILED) munmap(sq, r.sqRingSize);
+        close(fd);
+        return false;
+    }
+
+    char* sqBase = reinterpret_cast<char*>(sq);
+    char* cqBase = reinterpret_cast<char*>(cq);
+    r.ringFd = fd;
+    r.sqRing = sq;
+    r.cqRing = cq;
+    r.sqes = reinterpret_cast<io_uring_sqe*>(sqes);
+    r.sqEntries = p.sq_entries;
+    r.sqHead = reinterpret_cast<unsigned*>(sqBase + p.sq_off.head);
+    r.sqTail = reinterpret_cast<unsigned*>(sqBase + p.sq_off.tail);
+    r.sqMask = reinterpret_cast<unsigned*>(sqBase + p.sq_off.ring_mask);
+    r.sqArray = reinterpret_cast<unsigned*>(sqBase + p.sq_off.array);
+    r.cqHead = reinterpret_cast<unsigned*>(cqBase + p.cq_off.head);
+    r.cqTail = reinterpret_cast<unsigned*>(cqBase + p.cq_off.tail);
+    r.cqMask = reinterpret_cast<unsigned*>(cqBase + p.cq_off.ring_mask);
+    r.cqes = reinterpret_cast<io_uring_cqe*>(cqBase + p.cq_off.cqes);
+    return true;
+}
+
+static void uringTeardown(AsyncReader& r) {
+    if (r.ringFd < 0) return;
+    munmap(r.sqes, r.sqEntries * sizeof(io_uring_sqe));
+    if (r.cqRing != r.sqRing) munmap(r.cqRing, r.cqRingSize);
+    munmap(r.sqRing, r.sqRingSize);
+    close(r.ringFd);
+    r.ringFd = -1;
+}
+
+static void finishRead(AsyncReader& r, BlockRead req, bool ok) {
+    if (!ok) std::memset(req.buf, 0, r.fs->blockSize);
+    else if (r.usingUring) ext2CacheOverlay(*r.fs, req.blockIndex, req.buf); // unflushed writes win
+    req.result = ok ? 0 : -1;
+    r.done.push_back(req);
+    r.inFlight--;
+}
+
+// Splits one block read into image-file segments and queues an SQE for
+// each. Sparse parts are zero-filled here and need no I/O at all.
+// Returns false when the ring has no room for this block yet.
+static bool uringStart(AsyncReader& r, const BlockRead& req) {
+    Ext2File& fs = *r.fs;
+    VDIFile& vdi = *fs.part->vdi;
+    uint64_t offset = (uint64_t)req.blockIndex * fs.blockSize;
+    uint64_t diskOffset = fs.part->startByte + offset;
+
+    unsigned slotIdx = r.freeSlots.back();
+    AsyncReader::Slot& slot = r.slots[slotIdx];
+    slot.segs.clear();
+    slot.segOffsets.clear();
+    if (offset + fs.blockSize > fs.part->sizeBytes || diskOffset + fs.blockSize > vdi.diskSize) {
+        r.inFlight++;
+        finishRead(r, req, false);
+        return true;
+    }
+
+    uint8_t* out = reinterpret_cast<uint8_t*>(req.buf);
+    size_t pos = 0;
+    while (pos < fs.blockSize) {
+        size_t run = fs.blockSize - pos;
+        int64_t physical = vdiTranslate(vdi, diskOffset + pos, run);
+        if (physical < 0) {
+            std::memset(out + pos, 0, run);
+        } else {
+            slot.segs.push_back({out + pos, run});
+            slot.segOffsets.push_back((uint64_t)physical);
+        }
+        pos += run;
+    }
+    if (r.sqesInFlight + slot.segs.size() > r.sqEntries) return false;
+
+    r.freeSlots.pop_back();
+    r.inFlight++;
+    if (slot.segs.empty()) {
+        r.freeSlots.push_back(slotIdx);
+        finishRead(r, req, true);
+        return true;
+    }
+    slot.req = req;
+    slot.pending = (unsigned)slot.segs.size();
+    slot.failed = false;
+    for (size_t i = 0; i < slot.segs.size(); i++) {
+        unsigned tail = *r.sqTail;
+        unsigned idx = tail & *r.sqMask;
+        io_uring_sqe* sqe = &r.sqes[idx];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READV;
+        sqe->fd = vdi.fd;
+        sqe->addr = (uint64_t)(uintptr_t)&slot.segs[i];
+        sqe->len = 1;
+        sqe->off = slot.segOffsets[i];
+        sqe->user_data = ((uint64_t)slotIdx << 32) | i;
+        r.sqArray[idx] = idx;
+        __atomic_store_n(r.sqTail, tail + 1, __ATOMIC_RELEASE);
+        r.sqesInFlight++;
+        r.unsubmitted++;
+    }
+    return true;
+}
+
+static void uringDrain(AsyncReader& r) {
+    unsigned head = *r.cqHead;
+    unsigned tail = __atomic_load_n(r.cqTail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        io_uring_cqe* cqe = &r.cqes[head & *r.cqMask];
+        unsigned slotIdx = (unsigned)(cqe->user_data >> 32);
+        unsigned seg = (unsigned)(cqe->user_data & 0xFFFFFFFF);
+        AsyncReader::Slot& slot = r.slots[slotIdx];
+        if (cqe->res < 0) {
+            slot.failed = true;
+        } else if ((size_t)cqe->res < slot.segs[seg].iov_len) {
+            // short read: finish the rest synchronously
+            size_t got = (size_t)cqe->res;
+            size_t want = slot.segs[seg].iov_len - got;
+            if (preadFull(r.fs->part->vdi->fd, (uint8_t*)slot.segs[seg].iov_base + got, want,
+                          slot.segOffsets[seg] + got) < want)
+                slot.failed = true;
+        }
+        r.sqesInFlight--;
+        if (--slot.pending == 0) {
+            finishRead(r, slot.req, !slot.failed);
+            r.freeSlots.push_back(slotIdx);
+        }
+        head++;
+    }
+    __atomic_store_n(r.cqHead, head, __ATOMIC_RELEASE);
+}
+
+static void poolWorker(AsyncReader* r);
+
+// Hands the kernel every SQE not yet submitted and, with waitFor > 0,
+// waits for that many completions. The kernel may take fewer SQEs than
+// offered, or none (EAGAIN/EBUSY while completions are backed up); the
+// rest stay in `unsubmitted` and go with the next call, after the caller
+// has drained the completion queue. On any other error the ring is given
+// up: reads in flight fail and the thread pool takes over the queue.
+static void uringEnter(AsyncReader& r, unsigned waitFor) {
+    for (;;) {
+        unsigned flags = waitFor ? IORING_ENTER_GETEVENTS : 0;
+        long n = syscall(__NR_io_uring_enter, r.ringFd, r.unsubmitted, waitFor, flags, nullptr, 0);
+        if (n >= 0) {
+            r.unsubmitted -= std::min<unsigned>((unsigned)n, r.unsubmitted);
+            return;
+        }
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EBUSY) {
+            std::this_thread::yield();
+            return;
+        }
+        std::cerr << "io_uring_enter failed (" << std::strerror(errno) << "), using threads\n";
+        uringTeardown(r);
+        for (AsyncReader::Slot& slot : r.slots) {
+            if (slot.pending == 0) continue;
+            slot.pending = 0;
+            finishRead(r, slot.req, false);
+        }
+        r.slots.clear();
+        r.freeSlots.clear();
+        r.sqesInFlight = r.unsubmitted = 0;
+        r.usingUring = false;
+        unsigned workers = std::min(r.depth, std::max(2u, std::thread::hardware_concurrency()));
+        for (unsigned i = 0; i < workers; i++)
+            r.pool.emplace_back(poolWorker, &r);
+        return;
+    }
+}
+
+static void poolWorker(AsyncReader* r) {
+    std::vector<uint8_t> scratch;
+    for (;;) {
+        BlockRead req;
+        {
+            std::unique_lock<std::mutex> lock(r->poolLock);
+            r->poolWake.wait(lock, [r] { return r->stopping || !r->poolWork.empty(); });
+            if (r->poolWork.empty()) return;
+            req = r->poolWork.front();
+            r->poolWork.pop_front();
+        }
+        bool ok = ext2ReadBlock(*r->fs, req.blockIndex, req.buf);
+        {
+            std::lock_guard<std::mutex> lock(r->poolLock);
+            finishRead(*r, req, ok);
+        }
+        r->poolDone.notify_all();
+    }
+}
+
+// Opens an async reader over `fs`. With allowUring=false (or when the
+// kernel refuses io_uring) the thread pool is used instead.
+bool asyncOpen(AsyncReader& r, Ext2File& fs, unsigned depth, bool allowUring = true) {
+    r.fs = &fs;
+    r.depth = std::max(1u, depth);
+    r.usingUring = allowUring && uringSetup(r, r.depth * 2);
+    if (r.usingUring) {
+        r.slots.resize(r.depth);
+        for (unsigned i = r.depth; i-- > 0;) r.freeSlots.push_back(i);
+        return true;
+    }
+    unsigned workers = std::min(r.depth, std::max(2u, std::thread::hardware_concurrency()));
+    for (unsigned i = 0; i < workers; i++)
+        r.pool.emplace_back(poolWorker, &r);
+    return true;
+}
+
+// Adds a read to the queue. Nothing is issued until asyncSubmit/asyncReap.
+void asyncQueue(AsyncReader& r, uint32_t blockIndex, void* buf, uint64_t tag) {
+    BlockRead req;
+    req.blockIndex = blockIndex;
+    req.buf = buf;
+    req.tag = tag;
+    r.queued.push_back(req);
+}
+
+// Moves queued reads into flight, up to `depth`. Returns how many started.
+size_t asyncSubmit(AsyncReader& r) {
+    size_t started = 0;
+    if (r.usingUring) {
+        while (!r.queued.empty() && !r.freeSlots.empty() && uringStart(r, r.queued.front())) {
+            r.queued.pop_front();
+            started++;
+        }
+        // a partial submit leaves the rest for the next call
+        while (r.usingUring && r.unsubmitted > 0) {
+            unsigned before = r.unsubmitted;
+            uringEnter(r, 0);
+            if (r.unsubmitted == before) break;
+        }
+        if (r.usingUring) return started;
+    }
+    {
+        std::lock_guard<std::mutex> lock(r.poolLock);
+        while (!r.queued.empty() && r.inFlight < r.depth) {
+            r.poolWork.push_back(r.queued.front());
+            r.queued.pop_front();
+            r.inFlight++;
+            started++;
+        }
+    }
+    if (started) r.poolWake.notify_all();
+    return started;
+}
+
+// Waits until at least `minComplete` reads have finished (fewer if less
+// than that are outstanding), appends them to `out` and tops the queue up
+// again. Returns the number appended.
+size_t asyncReap(AsyncReader& r, std::vector<BlockRead>& out, size_t minComplete = 1) {
+    asyncSubmit(r);
+    while (r.usingUring) {
+        uringDrain(r);
+        size_t want = std::min(minComplete, r.done.size() + r.inFlight);
+        if (r.done.size() >= want) break;
+        uringEnter(r, 1); // also submits anything a short submit left behind
+        if (!r.usingUring) asyncSubmit(r);
+    }
+    if (!r.usingUring) {
+        std::unique_lock<std::mutex> lock(r.poolLock);
+        r.poolDone.wait(lock, [&r, minComplete] {
+            return r.done.size() >= std::min(minComplete, r.done.size() + r.inFlight);
+        });
+    }
+    size_t n;
+    {
+        std::lock_guard<std::mutex> lock(r.poolLock);
+        n = r.done.size();
+        out.insert(out.end(), r.done.begin(), r.done.end());
+        r.done.clear();
+    }
+    asyncSubmit(r);
+    return n;
+}
+
+// True while anything is queued, in flight or not yet reaped.
+bool asyncBusy(AsyncReader& r) {
+    std::lock_guard<std::mutex> lock(r.poolLock);
+    return !r.queued.empty() || r.inFlight > 0 || !r.done.empty();
+}
+
+// Waits for outstanding reads and releases the ring or the pool.
+void asyncClose(AsyncReader& r) {
+    std::vector<BlockRead> sink;
+    r.queued.clear();
+    while (asyncBusy(r)) asyncReap(r, sink, 1);
+    uringTeardown(r);
+    {
+        std::lock_guard<std::mutex> lock(r.poolLock);
+        r.stopping = true;
+    }
+    r.poolWake.notify_all();
+    for (auto& t : r.pool) t.join();
+    r.pool.clear();
+}
+
+// Reads a whole file with up to `depth` blocks in flight. The block map
+// is resolved first (one read per indirect block), then data blocks are
+// streamed through the async reader. `cb` sees (logical block, data) in
+// completion order; holes are passed as zero blocks.
+bool readFileAsync(Ext2File* fs, const Inode* inode, unsigned depth,
+                   const std::function<void(uint32_t, const uint8_t*)>& cb) {
+    uint32_t count = (uint32_t)((inodeSize(inode) + fs->blockSize - 1) / fs->blockSize);
+    std::vector<uint32_t> blocks;
+    listFileBlocks(fs, inode, count, blocks);
+
+    AsyncReader r;
+    asyncOpen(r, *fs, depth);
+    std::vector<std::vector<uint8_t>> bufs(r.depth, std::vector<uint8_t>(fs->blockSize));
+    std::vector<unsigned> freeBufs;
+    for (unsigned i = 0; i < r.depth; i++) freeBufs.push_back(i);
+    std::vector<uint8_t> zeros(fs->blockSize, 0);
+
+    bool ok = true;
+    uint32_t next = 0;
+    std::vector<BlockRead> batch;
+    while (next < count || asyncBusy(r)) {
+        while (next < count && !freeBufs.empty()) {
+            if (blocks[next] == 0) {
+                cb(next++, zeros.data());
+                continue;
+            }
+            unsigned b = freeBufs.back();
+            freeBufs.pop_back();
+            asyncQueue(r, blocks[next], bufs[b].data(), ((uint64_t)next << 32) | b);
+            next++;
+        }
+        if (!asyncBusy(r)) continue;
+        batch.clear();
+        asyncReap(r, batch, 1);
+        for (const BlockRead& c : batch) {
+            if (c.result != 0) ok = false;
+            cb((uint32_t)(c.tag >> 32), reinterpret_cast<const uint8_t*>(c.buf));
+            freeBufs.push_back((unsigned)(c.tag & 0xFFFFFFFF));
+        }
+    }
+    asyncClose(r);
+    return ok;
+}
+
+// Reads every inode table of every group with up to `depth` blocks in
+// flight and calls `cb` for each inode slot, used or not.
+bool scanInodeTablesAsync(Ext2File* fs, unsigned depth,
+                          const std::function<void(uint32_t, const Inode&)>& cb) {
+    uint32_t ipg = fs->sb.s_inodes_per_group;
+    uint32_t inodesPerBlock = fs->blockSize / fs->inodeSize;
+    uint32_t tableBlocks = (ipg + inodesPerBlock - 1) / inodesPerBlock;
+
+    AsyncReader r;
+    asyncOpen(r, *fs, depth);
+    std::vector<std::vector<uint8_t>> bufs(r.depth, std::vector<uint8_t>(fs->blockSize));
+    std::vector<unsigned> freeBufs;
+    for (unsigned i = 0; i < r.depth; i++) freeBufs.push_back(i);
+
+    bool ok = true;
+    uint64_t next = 0, total = (uint64_t)fs->numBlockGroups * tableBlocks;
+    std::vector<BlockRead> batch;
+    while (next < total || asyncBusy(r)) {
+        while (next < total && !freeBufs.empty()) {
+            uint32_t group = (uint32_t)(next / tableBlocks);
+            uint32_t blk = (uint32_t)(next % tableBlocks);
+            unsigned b = freeBufs.back();
+            freeBufs.pop_back();
+            asyncQueue(r, fs->bgdt[group].bg_inode_table + blk, bufs[b].data(), (next << 32) | b);
+            next++;
+        }
+        batch.clear();
+        asyncReap(r, batch, 1);
+        for (const BlockRead& c : batch) {
+            if (c.result != 0) ok = false;
+            uint64_t idx = c.tag >> 32;
+            uint32_t group = (uint32_t)(idx / tableBlocks);
+            uint32_t first = (uint32_t)(idx % tableBlocks) * inodesPerBlock;
+            const uint8_t* data = reinterpret_cast<const uint8_t*>(c.buf);
+            for (uint32_t i = 0; i < inodesPerBlock && first + i < ipg; i++) {
+                uint32_t iNum = group * ipg + first + i + 1;
+                if (iNum > fs->sb.s_inodes_count) break;
+                Inode inode;
+                std::memcpy(&inode, data + i * fs->inodeSize, sizeof(Inode));
+                inodeCacheOverlay(fs, iNum, &inode);
+                cb(iNum, inode);
+            }
+            freeBufs.push_back((unsigned)(c.tag & 0xFFFFFFFF));
+        }
+    }
+    asyncClose(r);
+    return ok;
+}
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+// --------------------------- Bulk inode scanning ---------------------------
+//
+// Walks a group's inode table in large sequential chunks instead of one
+// fetchInode (and one block read) per inode. The inode bitmap is read
+// first, chunks without a used inode are skipped, and only the used
+// inodes are passed to the visitor. Dirty cached inodes replace what is
+// on disk, so the scan sees the same state fetchInode would.
+
+// Visitor for inode scans; return false to stop the scan.
+typedef std::function<bool(uint32_t iNum, const Inode &inode)> InodeVisitor;
+
+const uint32_t INODE_SCAN_CHUNK_BLOCKS = 64;
+
+// Scans one block group. Returns false if a read failed or the visitor
+// stopped the scan.
+bool scanGroupInodes(Ext2File *fs, uint32_t group, const InodeVisitor &visit,
+                     uint32_t chunkBlocks = INODE_SCAN_CHUNK_BLOCKS) {
+    uint32_t ipg = fs->sb.s_inodes_per_group;
+    uint32_t inodesPerBlock = fs->blockSize / fs->inodeSize;
+    uint32_t tableBlocks = (ipg + inodesPerBlock - 1) / inodesPerBlock;
+    uint32_t firstINum = group * ipg + 1;
+
+    std::vector<uint8_t> bitmap(fs->blockSize);
+    if (!ext2ReadBlock(*fs, fs->bgdt[group].bg_inode_bitmap, bitmap.data()))
+        return false;
+    auto used = [&](uint32_t i) { return (bitmap[i / 8] >> (i % 8)) & 1; };
+
+    std::vector<uint8_t> chunk((size_t)chunkBlocks * fs->blockSize);
+    for (uint32_t b = 0; b < tableBlocks; b += chunkBlocks) {
+        uint32_t end = std::min(tableBlocks, b + chunkBlocks);
+        uint32_t lastInode = std::min(ipg, end * inodesPerBlock);
+
+        // narrow the chunk to the blocks that actually hold used inodes
+        uint32_t lo = UINT32_MAX, hi = 0;
+        for (uint32_t i = b * inodesPerBlock; i < lastInode; i++) {
+            if ((i % 8) == 0 && i + 8 <= lastInode && bitmap[i / 8] == 0) {
+                i += 7;
+                continue;
+            }
+            if (used(i)) {
+                if (lo == UINT32_MAX) lo = i;
+                hi = i;
+            }
+        }
+        if (lo == UINT32_MAX) continue;
+
+        uint32_t loBlock = lo / inodesPerBlock, hiBlock = hi / inodesPerBlock;
+        if (!ext2ReadBlocks(*fs, fs->bgdt[group].bg_inode_table + loBlock,
+                            hiBlock - loBlock + 1, chunk.data()))
+            return false;
+        for (uint32_t i = lo; i <= hi; i++) {
+            if (!used(i)) continue;
+            uint32_t iNum = firstINum + i;
+            if (iNum > fs->sb.s_inodes_count) break;
+            Inode inode;
+            std::memcpy(&inode, chunk.data() + (size_t)(i - loBlock * inodesPerBlock) * fs->inodeSize,
+                        sizeof(Inode));
+            inodeCacheOverlay(fs, iNum, &inode);
+            if (!visit(iNum, inode)) return false;
+        }
+    }
+    return true;
+}
+
+// Scans every group in order.
+bool scanAllInodes(Ext2File *fs, const InodeVisitor &visit) {
+    for (uint32_t g = 0; g < fs->numBlockGroups; g++)
+        if (!scanGroupInodes(fs, g, visit)) return false;
+    return true;
+}
+
+// readdir-plus: a directory's entries together with their inodes. The
+// entries' inode-table blocks are sorted and read in ascending order, each
+// exactly once; blocks at most READDIR_PLUS_GAP_BLOCKS apart are fetched
+// in one read (the few unneeded blocks cost less than another seek).
+const uint32_t READDIR_PLUS_GAP_BLOCKS = 4;
+
+struct DirEntryPlus {
+    uint32_t iNum;
+    uint8_t fileType;
+    std::string name;
+    Inode inode;
+};
+
+// Fills `out` with the entries of directory dirINum ("." and ".."
+// included), in directory order. Returns false if the directory cannot be
+// read; entries whose inode block fails to read are zeroed.
+bool readDirPlus(Ext2File *fs, uint32_t dirINum, std::vector<DirEntryPlus> &out) {
+    out.clear();
+    Directory *d = openDir(fs, dirINum);
+    if (!d) return false;
+    uint32_t iNum;
+    uint8_t type;
+    char name[256];
+    while (getNextDirent(d, iNum, name, &type))
+        out.push_back(DirEntryPlus{iNum, type, name, Inode()});
+    closeDir(d);
+
+    // (inode-table block, byte offset, entry) sorted by block
+    struct Want {
+        uint32_t block;
+        uint32_t offset;
+        size_t entry;
+    };
+    std::vector<Want> wants;
+    wants.reserve(out.size());
+    for (size_t i = 0; i < out.size(); i++) {
+        if (out[i].iNum == 0 || out[i].iNum > fs->sb.s_inodes_count) continue;
+        Want w;
+        w.entry = i;
+        inodeLocation(fs, out[i].iNum, w.block, w.offset);
+        wants.push_back(w);
+    }
+    std::sort(wants.begin(), wants.end(),
+              [](const Want &a, const Want &b) { return a.block < b.block; });
+
+    std::vector<uint8_t> run;
+    for (size_t i = 0; i < wants.size();) {
+        // extend the read while the next block needed is close enough
+        size_t j = i + 1;
+        while (j < wants.size() && wants[j].block - wants[j - 1].block <= READDIR_PLUS_GAP_BLOCKS &&
+               wants[j].block - wants[i].block < INODE_SCAN_CHUNK_BLOCKS)
+            j++;
+        uint32_t first = wants[i].block;
+        uint32_t count = wants[j - 1].block - first + 1;
+        run.resize((size_t)count * fs->blockSize);
+        bool ok = ext2ReadBlocks(*fs, first, count, run.data());
+        for (size_t k = i; k < j; k++) {
+            DirEntryPlus &e = out[wants[k].entry];
+            if (ok)
+                std::memcpy(&e.inode, run.data() + (size_t)(wants[k].block - first) * fs->blockSize + wants[k].offset,
+                            sizeof(Inode));
+            else
+                std::memset(&e.inode, 0, sizeof(Inode));
+            inodeCacheOverlay(fs, e.iNum, &e.inode);
+        }
+        i = j;
+    }
+    return true;
+}
+
+// --------------------------- Parallel group scans ---------------------------
+//
+// Block groups are independent, so whole-filesystem scans can hand them to
+// worker threads. WorkQueues is a small work-stealing pool: each worker
+// owns a lane, takes its own work LIFO and steals FIFO from other lanes
+// when it runs dry. Work may push more work (the tree walker does).
+// Workers that find nothing to steal sleep until an item is pushed or the
+// last one finishes.
+
+template <typename T>
+struct WorkQueues {
+    struct Lane {
+        std::deque<T> items;
+        std::mutex lock;
+    };
+    std::vector<std::unique_ptr<Lane>> lanes;
+    std::atomic<size_t> pending{0}; // queued or still being processed
+    std::atomic<uint64_t> pushes{0}; // changed under idleLock
+    std::mutex idleLock;
+    std::condition_variable idle;
+
+    explicit WorkQueues(unsigned n) {
+        for (unsigned i = 0; i < n; i++) lanes.emplace_back(new Lane());
+    }
+    void push(unsigned lane, T item) {
+        pending++;
+        {
+            Lane& l = *lanes[lane % lanes.size()];
+            std::lock_guard<std::mutex> lock(l.lock);
+            l.items.push_back(std::move(item));
+        }
+        {
+            std::lock_guard<std::mutex> lock(idleLock);
+            pushes++;
+        }
+        idle.notify_one();
+    }
+    bool pop(unsigned self, T& out) {
+        {
+            Lane& own = *lanes[self];
+            std::lock_guard<std::mutex> lock(own.lock);
+            if (!own.items.empty()) {
+                out = std::move(own.items.back());
+                own.items.pop_back();
+                return true;
+            }
+        }
+        for (size_t i = 1; i < lanes.size(); i++) {
+            Lane& victim = *lanes[(self + i) % lanes.size()];
+            std::lock_guard<std::mutex> lock(victim.lock);
+            if (!victim.items.empty()) {
+                out = std::move(victim.items.front());
+                victim.items.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+    // Call once per popped item after processing it.
+    void finished() {
+        if (--pending == 0) {
+            std::lock_guard<std::mutex> lock(idleLock);
+            idle.notify_all();
+        }
+    }
+    // Sleeps until something was pushed after `seen` was read from
+    // `pushes`, or no work is left.
+    void waitForWork(uint64_t seen) {
+        std::unique_lock<std::mutex> lock(idleLock);
+        idle.wait(lock, [this, seen] { return pushes.load() != seen || pending.load() == 0; });
+    }
+};
+
+// Runs `work(item, worker)` on `threads` workers until every queue is empty
+// and no item is still being processed.
+template <typename T>
+void runWorkQueues(WorkQueues<T>& q, const std::function<void(T&, unsigned)>& work) {
+    auto loop = [&q, &work](unsigned self) {
+        T item;
+        for (;;) {
+            uint64_t seen = q.pushes.load();
+            if (q.pop(self, item)) {
+                work(item, self);
+                q.finished();
+            } else if (q.pending.load() == 0) {
+                return;
+            } else {
+                q.waitForWork(seen);
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < q.lanes.size(); i++) workers.emplace_back(loop, i);
+    loop(0);
+    for (auto& w : workers) w.join();
+}
+
+// Hands every block group to one of `threads` workers. Each worker keeps
+// its own Result; `perGroup` fills it and `merge` folds the per-thread
+// results together at the end. Groups are dealt out in contiguous ranges
+// so a worker's reads stay close together until it has to steal.
+template <typename Result>
+Result parallelGroupScan(Ext2File* fs, unsigned threads,
+                         const std::function<void(uint32_t, Result&)>& perGroup,
+                         const std::function<void(Result&, const Result&)>& merge) {
+    threads = std::max(1u, std::min(threads, fs->numBlockGroups));
+    WorkQueues<uint32_t> q(threads);
+    for (uint32_t g = fs->numBlockGroups; g-- > 0;)
+        q.push((unsigned)((uint64_t)g * threads / fs->numBlockGroups), g);
+
+    std::vector<Result> partial(threads);
+    runWorkQueues<uint32_t>(q, [&](uint32_t& group, unsigned worker) {
+        perGroup(group, partial[worker]);
+    });
+    Result total = partial[0];
+    for (unsigned i = 1; i < threads; i++) merge(total, partial[i]);
+    return total;
+}
+
+// Space and inode usage, as a `du`-style summary of the whole filesystem.
+struct FsUsage {
+    uint64_t files = 0;
+    uint64_t dirs = 0;
+    uint64_t symlinks = 0;
+    uint64_t other = 0;
+    uint64_t bytes = 0;       // sum of i_size
+    uint64_t diskBytes = 0;   // sum of i_blocks * 512
+};
+
+FsUsage computeUsage(Ext2File* fs, unsigned threads) {
+    return parallelGroupScan<FsUsage>(
+        fs, threads,
+        [fs](uint32_t group, FsUsage& u) {
+            scanGroupInodes(fs, group, [fs, &u](uint32_t iNum, const Inode& inode) {
+                if (inode.i_links_count == 0) return true;
+                // reserved inodes (journal, resize, ...) are not user data
+                if (iNum < fs->sb.s_first_ino && iNum != 2) return true;
+                switch (inode.i_mode & 0xF000) {
+                case 0x8000: u.files++; break;
+                case 0x4000: u.dirs++; break;
+                case 0xA000: u.symlinks++; break;
+                default: u.other++; break;
+                }
+                u.bytes += inodeSize(&inode);
+                u.diskBytes += (uint64_t)inode.i_blocks * 512;
+                return true;
+            });
+        },
+        [](FsUsage& into, const FsUsage& from) {
+            into.files += from.files;
+            into.dirs += from.dirs;
+            into.symlinks += from.symlinks;
+            into.other += from.other;
+            into.bytes += from.bytes;
+            into.diskBytes += from.diskBytes;
+        });
+}
+
+// Per-group consistency check: the free counts and directory count in each
+// descriptor against what the bitmaps and the inode table say.
+struct FsCheckReport {
+    uint32_t groupsChecked = 0;
+    std::vector<std::string> problems;
+};
+
+FsCheckReport checkGroups(Ext2File* fs, unsigned threads) {
+    FsCheckReport report = parallelGroupScan<FsCheckReport>(
+        fs, threads,
+        [fs](uint32_t group, FsCheckReport& r) {
+            const Ext2BlockGroupDescriptor& bg = fs->bgdt[group];
+            std::vector<uint8_t> bitmap(fs->blockSize);
+
+            uint32_t nblocks = blocksInGroup(fs, group);
+            ext2ReadBlock(*fs, bg.bg_block_bitmap, bitmap.data());
+            uint32_t freeBlocks = countZeroBits(bitmap.data(), nblocks);
+
+            ext2ReadBlock(*fs, bg.bg_inode_bitmap, bitmap.data());
+            uint32_t freeInodes = countZeroBits(bitmap.data(), fs->sb.s_inodes_per_group);
+
+            uint32_t dirs = 0;
+            scanGroupInodes(fs, group, [&dirs](uint32_t, const Inode& inode) {
+                if ((inode.i_mode & 0xF000) == 0x4000 && inode.i_links_count) dirs++;
+                return true;
+            });
+
+            auto report = [&](const char* what, uint32_t desc, uint32_t actual) {
+                if (desc == actual) return;
+                r.problems.push_back("group " + std::to_string(group) + ": " + what + " is " +
+                                     std::to_string(desc) + ", bitmaps/table say " +
+                                     std::to_string(actual));
+            };
+            report("bg_free_blocks_count", bg.bg_free_blocks_count, freeBlocks);
+            report("bg_free_inodes_count", bg.bg_free_inodes_count, freeInodes);
+            report("bg_used_dirs_count", bg.bg_used_dirs_count, dirs);
+            r.groupsChecked++;
+        },
+        [](FsCheckReport& into, const FsCheckReport& from) {
+            into.groupsChecked += from.groupsChecked;
+            into.problems.insert(into.problems.end(), from.problems.begin(), from.problems.end());
+        });
+    std::sort(report.problems.begin(), report.problems.end());
+    return report;
+}
+
+// --------------------------- Parallel tree walk ---------------------------
+//
+// walkTree visits every entry below a directory, `find`-style. Directories
+// are the work items: a worker lists one with openDir/getNextDirent,
+// reports each entry and pushes subdirectories onto its own lane, so it
+// goes depth-first while idle workers steal the oldest (largest) pending
+// subtrees from the other end.
+
+const uint8_t EXT2_FT_UNKNOWN = 0;
+const uint8_t EXT2_FT_REG_FILE = 1;
+const uint8_t EXT2_FT_DIR = 2;
+const uint8_t EXT2_FT_CHRDEV = 3;
+const uint8_t EXT2_FT_BLKDEV = 4;
+const uint8_t EXT2_FT_FIFO = 5;
+const uint8_t EXT2_FT_SOCK = 6;
+const uint8_t EXT2_FT_SYMLINK = 7;
+
+// Directory-entry file type for an inode mode.
+uint8_t modeToFileType(uint16_t mode) {
+    switch (mode & 0xF000) {
+    case 0x8000: return EXT2_FT_REG_FILE;
+    case 0x4000: return EXT2_FT_DIR;
+    case 0x2000: return EXT2_FT_CHRDEV;
+    case 0x6000: return EXT2_FT_BLKDEV;
+    case 0x1000: return EXT2_FT_FIFO;
+    case 0xC000: return EXT2_FT_SOCK;
+    case 0xA000: return EXT2_FT_SYMLINK;
+    default: return EXT2_FT_UNKNOWN;
+    }
+}
+
+// Called as visit(path, iNum, fileType) for every entry, from several
+// threads at once. For directories, returning false skips their contents.
+typedef std::function<bool(const std::string&, uint32_t, uint8_t)> TreeVisitor;
+
+struct WalkItem {
+    uint32_t iNum;
+    std::string path;
+};
+
+// Walks the tree under directory `root` (reported as `rootPath`, which is
+// not itself visited) on `threads` workers. Entries without a recorded
+// file type (no filetype feature) cost an inode read to classify.
+void walkTree(Ext2File* fs, uint32_t root, const std::string& rootPath, unsigned threads,
+              const TreeVisitor& visit) {
+    threads = std::max(1u, threads);
+    WorkQueues<WalkItem> q(threads);
+    q.push(0, WalkItem{root, rootPath == "/" ? "" : rootPath});
+
+    runWorkQueues<WalkItem>(q, [&](WalkItem& dir, unsigned worker) {
+        Directory* d = openDir(fs, dir.iNum);
+        if (!d) return;
+        uint32_t iNum;
+        uint8_t type;
+        char name[256];
+        while (getNextDirent(d, iNum, name, &type)) {
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                continue;
+            if (type == EXT2_FT_UNKNOWN) {
+                Inode inode;
+                if (fetchInode(fs, iNum, &inode) == 0) type = modeToFileType(inode.i_mode);
+            }
+            std::string path = dir.path + "/" + name;
+            if (visit(path, iNum, type) && type == EXT2_FT_DIR)
+                q.push(worker, WalkItem{iNum, std::move(path)});
+        }
+        closeDir(d);
+    });
+}
+
+// --------------------------- Creating files ---------------------------
+
+// Creates an empty inode of type/permissions `mode` named `name` in
+// directory parentINum, placed by allocateInodeFor. A directory gets its
+// "." and ".." block (in its own group, like any file data) and bumps the
+// parent's link count. Returns the new inode number, or 0 if the name is
+// taken or invalid or the disk is full (nothing is left allocated).
+uint32_t createInode(Ext2File* fs, uint32_t parentINum, const std::string& name, uint16_t mode) {
+    bool isDir = (mode & 0xF000) == 0x4000;
+    if (name.empty() || name.size() > 255 || name.find('/') != std::string::npos) return 0;
+    if (lookupName(fs, parentINum, name) != 0) return 0;
+    uint32_t iNum = allocateInodeFor(fs, parentINum, isDir);
+    if (iNum == 0) return 0;
+
+    Inode inode{};
+    inode.i_mode = mode;
+    inode.i_links_count = isDir ? 2 : 1;
+    inode.i_atime = inode.i_ctime = inode.i_mtime = (uint32_t)std::time(nullptr);
+    if (isDir) {
+        std::vector<uint8_t> buf(fs->blockSize, 0);
+        uint8_t dirType = (fs->sb.s_feature_incompat & 0x0002) ? EXT2_FT_DIR : 0;
+        DirEntryHead* dot = reinterpret_cast<DirEntryHead*>(buf.data());
+        *dot = DirEntryHead{iNum, 12, 1, dirType};
+        buf[sizeof(DirEntryHead)] = '.';
+        DirEntryHead* dotdot = reinterpret_cast<DirEntryHead*>(buf.data() + 12);
+        *dotdot = DirEntryHead{parentINum, (uint16_t)(fs->blockSize - 12), 2, dirType};
+        std::memcpy(buf.data() + 12 + sizeof(DirEntryHead), "..", 2);
+        if (writeFileBlocks(fs, iNum, &inode, 0, 1, buf.data()) != 0) {
+            freeInode(fs, iNum, true);
+            return 0;
+        }
+    }
+    writeInode(fs, iNum, &inode);
+
+    if (addDirent(fs, parentINum, name, iNum, modeToFileType(mode)) != 0) {
+        std::vector<uint32_t> blocks;
+        if (isDir) blocks.push_back(inode.i_block[0]);
+        releaseBlocks(fs, blocks);
+        freeInode(fs, iNum, isDir);
+        return 0;
+    }
+    if (isDir) {
+        Inode parent;
+        if (fetchInode(fs, parentINum, &parent) == 0) {
+            parent.i_links_count++;
+            writeInode(fs, parentINum, &parent);
+        }
+    }
+    return iNum;
+}
 
 // MAIN  FUNCTION
+// bench.cpp includes this file with STEP6_NO_MAIN to reuse the library.
+#ifndef STEP6_NO_MAIN
 int main(int argc, char *argv[])
 {
-    if (argc != 3)
+    if (argc != 3 && !(argc == 4 && std::string(argv[3]) == "--mmap"))
     {
-        std::cerr << "Usage: " << argv[0] << " <vdi file> <inode number>\n";
+        std::cerr << "Usage: " << argv[0] << " <vdi file> <inode number> [--mmap]\n";
         return 1;
     }
 
     std::string vdiPath = argv[1];
     uint32_t inodeNum = std::stoi(argv[2]);
+    bool useMmap = (argc == 4);
 
     VDIFile vdi;
-    if (!vdiOpen(vdi, vdiPath))
+    if (!vdiOpen(vdi, vdiPath, useMmap))
         return 1;
 
     MBRPartition part;
@@ -1108,6 +4994,4 @@ int main(int argc, char *argv[])
     vdiClose(vdi);
     return 0;
 }
-
-
-
+#endif // STEP6_NO_MAIN